@@ -57,6 +57,23 @@ static bool sEnableUI = true;
 // to the beginning after it starts playing.
 static bool sEnableStreamRestart = false;
 
+// Max megabit per second for each transfer from our webserver. 0 is unlimited.
+// A few times the media bitrate keeps cast control responsive on slow links.
+static int sMaxRateMbit = 0;
+
+// Command that writes fragmented MP4 to standard output, like ffmpeg
+// converting a file. Its output is cast while it is made, without
+// temporary files. The command is run for each request from the device.
+static std::string sPipeCommand = "";
+static const std::string sPipeStreamPath = "stream.mp4";
+
+// Cast local MP4 files as HLS that our webserver makes from the file.
+// The device can then seek in any MP4, without converting it first.
+static bool sMp4Hls = false;
+
+// Serve the webserver counters at /metrics, for Prometheus
+static bool sMetrics = false;
+
 static std::string sChromecastHost = "";
 static std::string sDeviceName = "";
 static std::vector<std::string> sFileList;
@@ -125,7 +142,13 @@ static void print_help(std::string programName)
               << "  --help|-h               Print this help message\n"
               << "  --list-devices|-l       List cast devices\n"
               << "  --list-devices-verbose  List cast devices, verbose info\n\n"
+              << "  --max-rate=MBIT         Limit each file transfer to MBIT megabit/s\n\n"
+              << "  --metrics               Serve webserver metrics for Prometheus at /metrics\n\n"
+              << "  --mp4-hls               Cast local MP4 files as HLS made from the file.\n"
+              << "                          Makes seeking work in any MP4\n\n"
               << "  --no-ui                 Disable the default text UI\n\n"
+              << "  --pipe-command=CMD      Cast the fragmented MP4 that shell command CMD\n"
+              << "                          writes to standard output, instead of FILE\n\n"
               << "  --stream-restart|-s     Start live stream from beginning\n\n"
               << rlog::logHelp()
               << "\n\n" << supported_filetypes_help_string()
@@ -241,6 +264,17 @@ static std::string url_encode(const std::string& inputString)
 
 static bool validate_file_list(const std::vector<std::string>& fileList)
 {
+    if (sPipeCommand != "")
+    {
+        if (fileList.size() != 0)
+        {
+            std::cout << "Can not play both a pipe command and files" << std::endl;
+            return false;
+        }
+        sNeedsWebserver = true;
+        return true;
+    }
+
     if (fileList.size() == 0)
     {
         std::cout << "At least one FILE required" << std::endl;
@@ -312,6 +346,27 @@ int handle_arguments(int argc, char* argv[])
             list_cast_devices(true);
             return 1;
         }
+        else if (arg.substr(0,11) == "--max-rate=")
+        {
+            sMaxRateMbit = atoi(arg.substr(11).c_str());
+            if (sMaxRateMbit <= 0)
+            {
+                std::cout << "Invalid rate: " << arg << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.substr(0,15) == "--pipe-command=")
+        {
+            sPipeCommand = arg.substr(15);
+        }
+        else if (arg == "--metrics")
+        {
+            sMetrics = true;
+        }
+        else if (arg == "--mp4-hls")
+        {
+            sMp4Hls = true;
+        }
         else if (arg == "--no-ui")
         {
             sEnableUI = false;
@@ -398,6 +453,10 @@ create_playlist(const std::string& hostName, uint16_t port, const std::vector<Pa
         {
             playlist.push_back(item.internalPath);
         }
+        else if (sMp4Hls && sPipeCommand == "" && ends_with(ascii_to_lower(item.publicPath), ".mp4"))
+        {
+            playlist.push_back(create_url(hostName, port, item.publicPath + ".m3u8"));
+        }
         else
         {
             playlist.push_back(create_url(hostName, port, item.publicPath));
@@ -408,6 +467,27 @@ create_playlist(const std::string& hostName, uint16_t port, const std::vector<Pa
     return playlist;
 }
 
+// Reads the next local playlist items ahead in our webserver,
+// so the device gets the first parts from memory
+class RWebPrefetcher : public MediaPrefetchCallBack
+{
+public:
+    RWebPrefetcher(RWeb& rweb, const std::string& urlPrefix)
+     :  mRWeb(rweb), mUrlPrefix(urlPrefix)
+    {}
+
+    void onMediaPrefetch( const std::string& mediaUrl ) override
+    {
+        if (mediaUrl.compare(0, mUrlPrefix.size(), mUrlPrefix) != 0) { return; }
+
+        mRWeb.prefetch(mediaUrl.substr(mUrlPrefix.size()));
+    }
+
+private:
+    RWeb& mRWeb;
+    std::string mUrlPrefix;
+};
+
 int main(int argc, char* argv[])
 {
     uint32_t myIp = getMyIp();
@@ -415,6 +495,7 @@ int main(int argc, char* argv[])
     std::string rwebRoot = ".";
     bool useRwebFilter = true;  // By default only serve specific files.
     std::unique_ptr<RWeb> rwebPtr;
+    std::unique_ptr<RWebPrefetcher> rwebPrefetcherPtr;    // Used by the player until it is destroyed
     std::unique_ptr<CastMediaPlayer> castMediaPlayerPtr;
     std::string ccFriendlyName;
     CliMediaStatus cliMediaStatus;
@@ -437,6 +518,11 @@ int main(int argc, char* argv[])
     }
 
     std::vector<PathFilterItem> rwebFilter = create_rweb_filter_from_file_list(sFileList);
+    if (sPipeCommand != "")
+    {
+        // Only the stream is served. Its body producer is used instead of the file
+        rwebFilter.push_back({sPipeStreamPath, sPipeStreamPath});
+    }
     std::vector<std::string> playlist = create_playlist(ipv4ToString(myIp), rwebPort, rwebFilter);
 
     for (auto x : rwebFilter)
@@ -456,6 +542,22 @@ int main(int argc, char* argv[])
         {
             rwebPtr->setFilter(rwebFilter);
         }
+        else
+        {
+            // The encoder may still write the segment the device asks for
+            rwebPtr->setTailFollow(true);
+        }
+        rwebPtr->setPacing(sMaxRateMbit * 1000000ULL / 8, 0);
+        rwebPtr->setMp4Faststart(true);
+        rwebPtr->setMp4Hls(sMp4Hls);
+        if (sMetrics)
+        {
+            rwebPtr->setMetricsPath("/metrics");
+        }
+        if (sPipeCommand != "")
+        {
+            rwebPtr->addBodyProducer(sPipeStreamPath, command_body_producer(sPipeCommand));
+        }
         if (rwebPtr->start() == false)
         {
             std::cerr << "*** Error: failed to start webserver" << std::endl;
@@ -467,6 +569,15 @@ int main(int argc, char* argv[])
 
     castMediaPlayerPtr = std::make_unique<CastMediaPlayer>(sChromecastHost, 8009);
     castMediaPlayerPtr->setPlayList(playlist);
+    if (sNeedsWebserver && sPipeCommand == "")
+    {
+        // RWeb supports Range requests, so local files can be seeked
+        castMediaPlayerPtr->setSeekEnabledMode(SeekEnabledMode::RangeSupported);
+        castMediaPlayerPtr->addRangeSupportedServer(create_url(ipv4ToString(myIp), rwebPort, ""));
+
+        rwebPrefetcherPtr = std::make_unique<RWebPrefetcher>(*rwebPtr, create_url(ipv4ToString(myIp), rwebPort, ""));
+        castMediaPlayerPtr->addMediaPrefetchCallBack(rwebPrefetcherPtr.get());
+    }
     if (sEnableUI)
     {
         castMediaPlayerPtr->addMediaStatusCallBack(&cliMediaStatus);
@@ -23,6 +23,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iomanip>
 #include <stdexcept>
 #include "rlog/RLog.h"
+#include "utils/Metrics.h"
+
+static metrics::Histogram& sReceiveLatency = metrics::Registry::global().histogram(
+    "castr_cast_receive_duration_seconds", "Time to read, parse and handle a received cast message");
+static metrics::Histogram& sSendLatency = metrics::Registry::global().histogram(
+    "castr_cast_send_duration_seconds", "Time to serialize and write a cast message");
+
+static metrics::Counter& message_counter(const char* direction, const std::string& nameSpace)
+{
+    return metrics::Registry::global().counter("castr_cast_messages_total", "Cast messages by namespace",
+                                               {{"direction", direction}, {"namespace", nameSpace}});
+}
 
 extensions::api::cast_channel::CastMessage
 getCastMessage(const char* sourceId, const char* destinationId, const char* nameSpace)
@@ -170,6 +182,7 @@ void CastLink::receiverLoop()
         while (mIsConnected)
         {
             messageLength = readMessageLength();
+            auto receiveStart = std::chrono::steady_clock::now();
 
             messageBuffer.resize(messageLength);
             readPayload(messageBuffer);
@@ -189,6 +202,9 @@ void CastLink::receiverLoop()
 
             dispatchCastMessage(receivedCastMessage);
 
+            sReceiveLatency.record(std::chrono::steady_clock::now() - receiveStart);
+            message_counter("received", receivedCastMessage.namespace_()).add();
+
             usleep(1000000);
         }
     }
@@ -224,6 +240,7 @@ void CastLink::send(const CastMessage& castMessage)
 
     int ret;
     uint32_t messageSize, messageSizeNBO;
+    auto sendStart = std::chrono::steady_clock::now();
     messageSize = castMessage.ByteSize();
     messageSizeNBO = htonl(messageSize);
 
@@ -251,6 +268,9 @@ void CastLink::send(const CastMessage& castMessage)
         throw std::runtime_error("CastLink send error");
     }
 
+    sSendLatency.record(std::chrono::steady_clock::now() - sendStart);
+    message_counter("sent", castMessage.namespace_()).add();
+
 }
 
 void CastLink::addCallback( CastMessageHandler* receiverPtr)
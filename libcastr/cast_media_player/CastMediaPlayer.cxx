@@ -67,6 +67,12 @@ CastMediaPlayer::addReceiverStatusCallBack(ReceiverStatusCallBack* callback)
     mReceiverHandler.addReceiverStatusCallBack(callback);
 }
 
+void
+CastMediaPlayer::addMediaPrefetchCallBack(MediaPrefetchCallBack* callback)
+{
+    mMediaPrefetchCallBacks.push_back(callback);
+}
+
 void
 CastMediaPlayer::onMediaFinished()
 {
@@ -109,6 +115,24 @@ CastMediaPlayer::loadMediaFromPlaylist()
     RLOG_N( "Load Media #" << mPlayListIndex << " - " << mPlayList[mPlayListIndex]  )
 
     mediaLoad( mPlayList[mPlayListIndex] );
+    prefetchUpcomingMedia();
+}
+
+// The items that next() plays after the current one
+void
+CastMediaPlayer::prefetchUpcomingMedia()
+{
+    static const std::size_t sPrefetchCount = 2;
+
+    for (std::size_t i=1; i<=sPrefetchCount && i<mPlayList.size(); ++i)
+    {
+        const std::string& mediaUrl = mPlayList[(mPlayListIndex + i) % mPlayList.size()];
+        RLOG(rlog::Verbose, "Prefetch media " << mediaUrl)
+        for (MediaPrefetchCallBack* callback : mMediaPrefetchCallBacks)
+        {
+            callback->onMediaPrefetch(mediaUrl);
+        }
+    }
 }
 
 void
@@ -210,6 +234,12 @@ CastMediaPlayer::setSeekEnabledMode(SeekEnabledMode mode)
     mSeekMode = mode;
 }
 
+void
+CastMediaPlayer::addRangeSupportedServer(const std::string& urlPrefix)
+{
+    mRangeSupportedServers.push_back(urlPrefix);
+}
+
 static bool
 isStreamingMedia(const std::string url)
 {
@@ -247,11 +277,22 @@ CastMediaPlayer::seekEnabled()
     {
         ret = true;
     }
-    if (mSeekMode == SeekEnabledMode::StreamingOnly
+    if ((mSeekMode == SeekEnabledMode::StreamingOnly || mSeekMode == SeekEnabledMode::RangeSupported)
         && mediaSupportsSeeking(mediaStatus()))
     {
         ret = true;
     }
+    if (mSeekMode == SeekEnabledMode::RangeSupported)
+    {
+        const std::string& contentId = mediaStatus().contentId;
+        for (const std::string& urlPrefix : mRangeSupportedServers)
+        {
+            if (contentId.compare(0, urlPrefix.size(), urlPrefix) == 0)
+            {
+                ret = true;
+            }
+        }
+    }
 
     RLOG(rlog::Debug, "seekEnabled " << mediaStatus().contentId << " " << ret )
     return ret;
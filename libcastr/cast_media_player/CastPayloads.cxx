@@ -42,7 +42,15 @@ getMediaLoadPayload(uint32_t requestId, const std::string& videoUrl)
     payload["media"] = Json::Value();
     payload["media"]["contentId"] = videoUrl;
     payload["media"]["streamType"] = "NONE";    // NONE,BUFFERED,LIVE
-    payload["media"]["contentType"] = extension_to_mime_type(videoUrl);
+    payload["media"]["contentType"] = std::string(extension_to_mime_type(videoUrl));
+
+    // RWeb serves MP4 files as HLS with fragmented MP4 segments. The
+    // receiver expects MPEG-TS segments in HLS unless it is told
+    if (ends_with(ascii_to_lower(videoUrl), ".mp4.m3u8"))
+    {
+        payload["media"]["hlsSegmentFormat"] = "fmp4";
+        payload["media"]["hlsVideoSegmentFormat"] = "fmp4";
+    }
 
     return getJsonString(payload);
 }
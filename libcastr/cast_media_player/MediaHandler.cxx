@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "rlog/RLog.h"
 #include "utils/Utils.h"
+#include "utils/Metrics.h"
 #include "json/json.h"
 #include "cast_media_player/MediaHandler.h"
 
@@ -104,6 +105,10 @@ MediaHandler::onCastMessage( CastLink* castLink, const CastMessage& castMessage
 {
     RLOG(rlog::Verbose, "MediaHandler::onCastMessage" )
 
+    static metrics::Histogram& sParseTime = metrics::Registry::global().histogram(
+        "castr_media_status_parse_duration_seconds", "Time to parse a MEDIA_STATUS message");
+    auto parseStart = std::chrono::steady_clock::now();
+
     Json::Reader jsonReader;
     Json::Value castPayloadJson;
     jsonReader.parse( castMessage.payload_utf8(), castPayloadJson );
@@ -183,6 +188,8 @@ MediaHandler::onCastMessage( CastLink* castLink, const CastMessage& castMessage
         }
     }
 
+    sParseTime.record(std::chrono::steady_clock::now() - parseStart);
+
     RLOG(rlog::Verbose, "Media Status: mediaSessionId=" << mMediaSessionId
         << ", playerState=" << to_string(mMediaStatus.playerState)
         << ", contentId=" << mMediaStatus.contentId
@@ -28,11 +28,24 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // chunks instead of as one big file.
 // Files are likely to re-start from the beginning if you try to seek
 // in a file that does not support it.
+// Files served by a web server that supports HTTP Range requests, like RWeb,
+// can also be seeked. Use RangeSupported and addRangeSupportedServer for that.
 enum class SeekEnabledMode
 {
     Never = 0,          // Seeking disabled for all media
     Always = 1,         // Seeking enabled for all media
-    StreamingOnly = 2   // Seeking enabled for streams. Disabled for regular files
+    StreamingOnly = 2,  // Seeking enabled for streams. Disabled for regular files
+    RangeSupported = 3  // Seeking enabled for streams, and files from range supported servers
+};
+
+// Told which playlist items play next when a new item is loaded, so the
+// server of the files can read them from disk before the device asks
+class MediaPrefetchCallBack
+{
+public:
+    virtual ~MediaPrefetchCallBack(){}
+
+    virtual void onMediaPrefetch( const std::string& mediaUrl ) = 0;
 };
 
 class CastMediaPlayer : public MediaFinishedCallBack
@@ -49,6 +62,7 @@ public:
     void previous();
 
     void setSeekEnabledMode(SeekEnabledMode mode);
+    void addRangeSupportedServer(const std::string& urlPrefix);  // e.g. "http://192.168.1.2:20000/"
     bool seekEnabled();             // Seeking enabled for currently playing media
     void seek(double targetTime);   // Seek to absolute time
     void seekDiff(double timeDiff); // Seek relative to current time
@@ -70,6 +84,7 @@ public:
     void setPlayList(std::vector<std::string> playList);
     void addMediaStatusCallBack(MediaStatusCallBack* callback);
     void addReceiverStatusCallBack(ReceiverStatusCallBack* callback);
+    void addMediaPrefetchCallBack(MediaPrefetchCallBack* callback);
 
     void onMediaFinished() override;
 
@@ -77,6 +92,7 @@ private:
 
     void loadPlayList(const std::string& playListFileName);
     void loadMediaFromPlaylist();
+    void prefetchUpcomingMedia();
     void verifyMediaConnection();
 
     uint32_t getNextRequestId();
@@ -105,11 +121,13 @@ private:
 
     std::vector<std::string> mPlayList;
     std::size_t mPlayListIndex;
+    std::vector<MediaPrefetchCallBack*> mMediaPrefetchCallBacks;
 
     std::string mHost;
     uint16_t mPort;
 
     SeekEnabledMode mSeekMode = SeekEnabledMode::StreamingOnly;
+    std::vector<std::string> mRangeSupportedServers;
 
     uint32_t mRequestId;
 };
@@ -23,8 +23,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <poll.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -32,16 +32,60 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <iostream>
 #include <filesystem>
+#include <limits>
 
 #include "rlog/RLog.h"
 #include "rweb/RWeb.h"
 #include "rweb/RWebUtils.h"
+#include "rweb/RWebEventLoop.h"
+#include "rweb/RWebUringLoop.h"
+#include "rweb/RWebMp4Index.h"
+#include "rweb/RWebPlaylist.h"
+#include "utils/Metrics.h"
 
 #define VERSION 1
 #define BUFSIZE 8096
+#define BAD_REQUEST 400
 #define FORBIDDEN 403
 #define NOTFOUND  404
+#define RANGE_NOT_SATISFIABLE 416
 
+#define BYTERANGES_BOUNDARY "RWEB_BYTERANGES_BOUNDARY"
+
+// Responses that can wait for the access log writer
+static const std::size_t sAccessLogSize = 4096;
+
+// Larger text files are always sent uncompressed
+static const off_t sMaxGzipFileSize = 16*1024*1024;
+
+// Connections waiting for accept, per listener. Many receivers
+// connecting at the same time must not get refused.
+static const int sListenBacklog = 1024;
+
+// Bytes read ahead from the start of a file, and after the index
+static const off_t sPrefetchSize = 1024*1024;
+
+// Larger MP4 indexes are not read ahead
+static const off_t sMaxPrefetchIndexSize = 32*1024*1024;
+
+// MP4 files with an index in memory, for HLS. A long movie takes some megabytes
+static const std::size_t sMp4IndexCacheSize = 8;
+
+// Larger playlists are not checked for blocking reloads too far ahead
+static const off_t sMaxCheckedPlaylistSize = 1024*1024;
+
+
+static std::string BAD_REQUEST_MESSAGE = "HTTP/1.1 400 Bad Request\n"
+"Content-Length: 131\n"
+"Connection: close\n"
+"Content-Type: text/html\n"
+"\n"
+"<html><head>\n"
+"<title>400 Bad Request</title>\n"
+"</head><body>\n"
+"<h1>Bad Request</h1>\n"
+"The request could not be understood.\n"
+"</body></html>\n";
 
 static std::string FORBIDDEN_MESSAGE = "HTTP/1.1 403 Forbidden\n"
 "Content-Length: 185\n"
@@ -56,7 +100,7 @@ static std::string FORBIDDEN_MESSAGE = "HTTP/1.1 403 Forbidden\n"
 "</body></html>\n";
 
 static std::string NOTFOUND_MESSAGE = "HTTP/1.1 404 Not Found\n"
-"Content-Length: 136\n"
+"Content-Length: 138\n"
 "Connection: close\n"
 "Content-Type: text/html\n"
 "\n"
@@ -67,27 +111,42 @@ static std::string NOTFOUND_MESSAGE = "HTTP/1.1 404 Not Found\n"
 "The requested URL was not found on this server.\n"
 "</body></html>\n";
 
-static void send_error_response(int errorNumber, int fdSocket)
+static void set_error_response(int errorNumber, RWebConnection& connection)
 {
     switch (errorNumber)
     {
+    case BAD_REQUEST:
+        connection.responseHead = BAD_REQUEST_MESSAGE;
+        break;
+
     case FORBIDDEN:
-        send(fdSocket,
-             FORBIDDEN_MESSAGE.c_str(),
-             FORBIDDEN_MESSAGE.size(),
-             MSG_NOSIGNAL);
+        connection.responseHead = FORBIDDEN_MESSAGE;
         break;
 
     case NOTFOUND:
-        send(fdSocket,
-             NOTFOUND_MESSAGE.c_str(),
-             NOTFOUND_MESSAGE.size(),
-             MSG_NOSIGNAL);
+        connection.responseHead = NOTFOUND_MESSAGE;
         break;
     }
 }
 
 
+static std::string content_range_header(const ByteRange& range, off_t fileSize,
+                                        const char* lineEnd = "\n")
+{
+    return "Content-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last)
+            + "/" + std::to_string(fileSize) + lineEnd;
+}
+
+static void set_range_not_satisfiable_response(off_t fileSize, RWebConnection& connection)
+{
+    connection.responseHead = "HTTP/1.1 416 Range Not Satisfiable\n"
+                              "Content-Length: 0\n"
+                              "Content-Range: bytes */" + std::to_string(fileSize) + "\n"
+                              "Connection: close\n"
+                              "\n";
+}
+
+
 static int log_error(const std::string& message, int errorCode=1)
 {
     RLOG(rlog::Critical, "ERROR: " << message << ",Errno=" << errno << ", pid=" << getpid());
@@ -101,11 +160,17 @@ static void log_http_error(int errorCode, const std::string& headline, const std
 
     switch (errorCode)
     {
+    case BAD_REQUEST: 
+        (void)snprintf(logbuffer, sizeof(logbuffer), "%d: BAD REQUEST: %s: %s", connectionId, headline.c_str(), message.c_str());
+        break;
     case FORBIDDEN: 
-        (void)sprintf(logbuffer,"%d: FORBIDDEN: %s: %s", connectionId, headline.c_str(), message.c_str());
+        (void)snprintf(logbuffer, sizeof(logbuffer), "%d: FORBIDDEN: %s: %s", connectionId, headline.c_str(), message.c_str());
         break;
     case NOTFOUND: 
-        (void)sprintf(logbuffer,"%d: NOT FOUND: %s: %s", connectionId, headline.c_str(), message.c_str()); 
+        (void)snprintf(logbuffer, sizeof(logbuffer), "%d: NOT FOUND: %s: %s", connectionId, headline.c_str(), message.c_str()); 
+        break;
+    case RANGE_NOT_SATISFIABLE: 
+        (void)snprintf(logbuffer, sizeof(logbuffer), "%d: RANGE NOT SATISFIABLE: %s: %s", connectionId, headline.c_str(), message.c_str()); 
         break;
     default:
         RLOG(rlog::Critical, "Log error. Unknown error code=" << errorCode);
@@ -114,141 +179,777 @@ static void log_http_error(int errorCode, const std::string& headline, const std
     RLOG_NETWORK(logbuffer);
 }
 
-static std::string get_origin_header_url(const std::string& request)
+// HTTP/1.1 keeps connections open unless the client asks to close.
+// HTTP/1.0 closes unless the client asks for keep-alive.
+static bool wants_keep_alive(const RWebRequest& request)
 {
-    std::size_t origin_header_start = request.find("Origin: ");
-    if (origin_header_start == std::string::npos)
+    if (request.versionMajor == 1 && request.versionMinor >= 1)
+    {
+        return !request.headerHasToken("Connection", "close");
+    }
+
+    return request.headerHasToken("Connection", "keep-alive");
+}
+
+static std::string connection_header(bool keepAlive)
+{
+    if (keepAlive)
+    {
+        return "Connection: keep-alive\n"
+               "Keep-Alive: timeout=" + std::to_string(RWebLoop::sKeepAliveTimeoutSeconds) + "\n";
+    }
+    return "Connection: close\n";
+}
+
+// Receivers fetch streams from a web page, so cross origin requests are allowed
+static std::string origin_headers(const RWebRequest& request)
+{
+    std::string originUrl(request.header("Origin"));
+    if (originUrl.empty())
     {
         return "";
     }
-    std::size_t origin_value_start = origin_header_start + 8;
-    std::size_t origin_end = request.find("\n", origin_value_start);
-    std::string result = request.substr(origin_value_start, origin_end - origin_value_start);
+    return "Access-Control-Allow-Origin: " + originUrl + "\n"
+           + "Vary: Origin\n";
+}
+
+static std::string render_response_head(const char* status, long contentLength,
+                                        const std::string& extraHeaders, bool keepAlive,
+                                        const std::string& contentType)
+{
+    std::string connectionResponse = connection_header(keepAlive);
+
+    char headerBuffer[BUFSIZE];
+    snprintf(headerBuffer, sizeof(headerBuffer),
+                           "HTTP/1.1 %s\nServer: rweb/%d.0\n"
+                           "Content-Length: %ld\n"
+                           "Accept-Ranges: bytes\n"
+                           "%s" // range and origin response
+                           "%s" // connection response
+                           "Content-Type: %s\n\n", status, VERSION, contentLength,
+                           extraHeaders.c_str(), connectionResponse.c_str(),
+                           contentType.c_str()); // Headers + a blank line
 
-    return result;
+    return headerBuffer;
 }
 
-void 
-RWeb::handleRequest(int fd, int connectionId)
+// Validators of the plain or gzip body, and Vary if there are both
+static std::string cache_headers(const RWebCachedFile& file, bool gzip)
 {
-    int file_fd;
-    long ret, len;
-    std::string buffer(BUFSIZE+1, 0);
+    std::string headers = "ETag: " + (gzip ? file.gzipEtag : file.etag) + "\n"
+                          "Last-Modified: " + file.lastModified + "\n";
+    if (file.compressible)
+    {
+        headers += "Vary: Accept-Encoding\n";
+    }
+    return headers;
+}
 
-    ret = read(fd, buffer.data(), BUFSIZE);     // read http request in one go
-    if (ret == 0 || ret == -1)    // read failure - abort
+// If-None-Match has priority over If-Modified-Since, see RFC 7232
+static bool is_not_modified(const RWebRequest& request, const RWebCachedFile& file, bool gzip)
+{
+    std::string_view ifNoneMatch = request.header("If-None-Match");
+    if (!ifNoneMatch.empty())
     {
-        log_http_error(FORBIDDEN,"failed to read browser request","", connectionId);
-        send_error_response(FORBIDDEN,fd);
-        return;
+        return etag_matches(ifNoneMatch, gzip ? file.gzipEtag : file.etag);
     }
-    if (ret > 0 && ret < BUFSIZE)    // return code is valid chars
+
+    time_t since;
+    std::string_view ifModifiedSince = request.header("If-Modified-Since");
+    if (ifModifiedSince.empty() || !parse_http_date(ifModifiedSince, since))
     {
-        buffer[ret]=0;        // terminate the buffer
+        return false;
     }
-    else
+    return file.mtime <= since;
+}
+
+static void set_not_modified_response(const RWebCachedFile& file, bool gzip, RWebConnection& connection)
+{
+    connection.closeBody();
+    connection.responseHead = "HTTP/1.1 304 Not Modified\n"
+                              "Server: rweb/" + std::to_string(VERSION) + ".0\n"
+                              + cache_headers(file, gzip)
+                              + connection_header(connection.keepAlive)
+                              + "\n";
+}
+
+static bool read_all(int fd, off_t size, std::string& content)
+{
+    content.resize(size);
+    off_t done = 0;
+    while (done < size)
     {
-        buffer[0]=0;
+        ssize_t ret = pread(fd, content.data() + done, size - done, done);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret <= 0) { return false; }
+        done += ret;
     }
-//     for (i=0; i<ret; i++)    // remove CR and LF characters
-//     {
-//         if (buffer[i] == '\r' || buffer[i] == '\n')
-//         {
-//             buffer[i]='*';
-//         }
-//     }
+    return true;
+}
+
+// Read "<file>.gz" if it was written after the file
+static bool read_precompressed(const RWebCachedFile& file, std::string& content)
+{
+    std::string gzipPath = file.internalPath + ".gz";
+    int fd = open(gzipPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return false; }
+
+    struct stat gzipStat = {};
+    bool ok = fstat(fd, &gzipStat) == 0 && S_ISREG(gzipStat.st_mode)
+              && (gzipStat.st_mtime > file.mtime
+                  || (gzipStat.st_mtime == file.mtime && gzipStat.st_mtim.tv_nsec >= file.mtimeNanoseconds))
+              && read_all(fd, gzipStat.st_size, content);
+    close(fd);
+    return ok;
+}
+
+// Body for gzip responses, made once per cache entry.
+// Empty if the file is too large or does not get smaller.
+static const std::string& gzip_body(const RWebCachedFile& file)
+{
+    std::call_once(file.gzipOnce, [&file]()
+    {
+        if (file.size > sMaxGzipFileSize) { return; }
+
+        if (read_precompressed(file, file.gzipBody))
+        {
+            RLOG(rlog::Verbose, "RWeb: using " << file.internalPath << ".gz");
+            return;
+        }
+
+        std::string content;
+        if (!read_all(file.fd, file.size, content)
+            || !gzip_compress(content, file.gzipBody)
+            || (off_t)file.gzipBody.size() >= file.size)
+        {
+            file.gzipBody.clear();
+            return;
+        }
+        RLOG(rlog::Verbose, "RWeb: compressed " << file.internalPath << " "
+             << file.size << " => " << file.gzipBody.size() << " bytes");
+    });
+
+    return file.gzipBody;
+}
+
+// Same headers as GET, so Content-Length is the size of the body not sent
+static void remove_body(RWebConnection& connection)
+{
+    connection.closeBody();
+    std::size_t headEnd = connection.responseHead.find("\n\n");
+    if (headEnd != std::string::npos)
+    {
+        connection.responseHead.resize(headEnd + 2);
+    }
+}
+
+// Serve the hot parts of the file body from the block cache
+static void use_block_cache(RWebBlockCache& blockCache, RWebConnection& connection)
+{
+    const RWebCachedFile& file = *connection.bodyFile;
+    std::deque<RWebBodyPart> parts;
+
+    if (connection.bodyRemaining > 0)
+    {
+        blockCache.appendRange(file, connection.bodyOffset, connection.bodyRemaining, parts);
+    }
+    for (RWebBodyPart& part : connection.bodyParts)
+    {
+        if (part.fileLength > 0)
+        {
+            blockCache.appendRange(file, part.fileOffset, part.fileLength, parts);
+        }
+        else
+        {
+            parts.push_back(std::move(part));
+        }
+    }
+
+    connection.bodyRemaining = 0;
+    connection.bodyParts.swap(parts);
+}
+
+// Send the body from the layout with moov first, instead of the file as it is
+static void use_faststart_layout(RWebConnection& connection)
+{
+    const RWebMp4Faststart& layout = *connection.bodyFile->faststart;
+    std::deque<RWebBodyPart> parts;
+
+    if (connection.bodyRemaining > 0)
+    {
+        layout.appendRange(connection.bodyOffset, connection.bodyRemaining, parts);
+    }
+    for (RWebBodyPart& part : connection.bodyParts)
+    {
+        if (part.fileLength > 0)
+        {
+            layout.appendRange(part.fileOffset, part.fileLength, parts);
+        }
+        else
+        {
+            parts.push_back(std::move(part));
+        }
+    }
+
+    connection.bodyRemaining = 0;
+    connection.bodyParts.swap(parts);
+}
 
-    RLOG_NETWORK(connectionId << ": NET Request:\n" << buffer.c_str());
-    
-    std::string method = buffer.substr(0,4);
+// Let the kernel read the parts of a file that a player reads first: the
+// start, and the index of MP4 files. The reads continue in the background
+static void read_ahead(const std::string& internalPath)
+{
+    int fd = open(internalPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return; }
+
+    struct stat fileStat = {};
+    if (fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode))
+    {
+        off_t size = fileStat.st_size;
+        posix_fadvise(fd, 0, std::min(size, sPrefetchSize), POSIX_FADV_WILLNEED);
+
+        off_t indexOffset = 0;
+        off_t indexLength = 0;
+        if (find_mp4_index(fd, size, indexOffset, indexLength) && indexLength <= sMaxPrefetchIndexSize)
+        {
+            posix_fadvise(fd, indexOffset, indexLength, POSIX_FADV_WILLNEED);
+
+            // With the index at the start, the first frames follow it
+            posix_fadvise(fd, indexOffset + indexLength, sPrefetchSize, POSIX_FADV_WILLNEED);
+        }
+        else
+        {
+            posix_fadvise(fd, std::max<off_t>(0, size - sPrefetchSize), sPrefetchSize, POSIX_FADV_WILLNEED);
+        }
+        RLOG(rlog::Verbose, "RWeb: read ahead " << internalPath << ", index " << indexLength << " bytes");
+    }
+    close(fd);
+}
+
+void
+RWeb::handleRequest(RWebConnection& connection)
+{
+    connection.priority = pr_Manifest;  // Error and server made responses are small
+    createResponse(connection);
+
+    const RWebRequest& request = connection.request;
+    if (!request.badRequest && equals_ignore_case(request.method, "HEAD"))
+    {
+        remove_body(connection);
+    }
+
+    if (mBlockCache && connection.bodyFile)
+    {
+        use_block_cache(*mBlockCache, connection);
+    }
+}
+
+void
+RWeb::createResponse(RWebConnection& connection)
+{
+    long len;
+    int connectionId = connection.connectionId;
+    const RWebRequest& request = connection.request;
 
-    if (!found_in({"GET ", "get "}, method))
+    RLOG(rlog::Debug, connectionId << ": NET Request:\n" << request.raw);
+
+    if (request.badRequest)
     {
-        log_http_error(FORBIDDEN,"Only simple GET operation supported", buffer, connectionId);
-        send_error_response(FORBIDDEN,fd);
+        log_http_error(BAD_REQUEST,"Malformed request", std::string(request.raw), connectionId);
+        set_error_response(BAD_REQUEST,connection);
         return;
     }
 
-    // http format is "GET file_name " + other stuff
-    // find the second space to ignore extra stuff
-    std::size_t fileNameEnd;
-    if ((fileNameEnd = buffer.find(' ', 4)) == std::string::npos)
+    if (!equals_ignore_case(request.method, "GET") && !equals_ignore_case(request.method, "HEAD"))
     {
-        log_http_error(FORBIDDEN,"Request Error", buffer, connectionId);
-        send_error_response(FORBIDDEN,fd);
+        log_http_error(FORBIDDEN,"Only simple GET and HEAD operations supported", std::string(request.raw), connectionId);
+        set_error_response(FORBIDDEN,connection);
         return;
     }
 
-    std::string fileName(buffer.substr(4, fileNameEnd-4));
-    if (fileName.find("..") != std::string::npos)
+    if (!mMetricsPath.empty() && request.path == mMetricsPath)
     {
-        log_http_error(FORBIDDEN,"Parent directory (..) path names not supported", fileName, connectionId);
-        send_error_response(FORBIDDEN,fd);
+        std::string body = metrics::Registry::global().render();
+        connection.keepAlive = wants_keep_alive(request);
+        connection.responseHead = render_response_head("200 OK", body.size(), "", connection.keepAlive,
+                                                       "text/plain; version=0.0.4") + body;
         return;
     }
 
+    // Path is already decoded, and ".." resolved by the parser
+    std::string fileName(request.path);
     if (ends_with(fileName, "/"))
     {
         fileName += "index.html";
     }
 
+    auto produced = mBodyProducers.find(fileName);
+    if (produced != mBodyProducers.end())
+    {
+        produceResponse(produced->second, connection);
+        return;
+    }
+
+    std::string mp4Path;
+    Mp4HlsResource hlsResource;
+    std::size_t segmentIndex = 0;
+    if (mMp4IndexCache && parse_mp4_hls_path(fileName, mp4Path, hlsResource, segmentIndex))
+    {
+        mp4HlsResponse(mp4Path, hlsResource, segmentIndex, connection);
+        return;
+    }
+
+    // Segments the encoder is still writing are sent while they grow.
+    // Checked before the file is opened, since the segment may only
+    // exist under its temporary name yet
+    if (mTailFollower && request.header("Range").empty() && growingResponse(fileName, connection))
+    {
+        return;
+    }
+
+    RWebFileCache::FilePtr file;
+    if (mFileCache)
+    {
+        file = mFileCache->get(fileName);
+    }
+    if (!file)
+    {
+        file = openFile(fileName, connection);
+        if (!file) { return; }
+    }
+
+    // LL-HLS blocking playlist reload. Sent when the playlist has the segment
+    // or part the client asks for, so it gets new parts as soon as they exist
+    HlsBlockingRequest hlsPosition;
+    if (mTailFollower && ends_with(file->internalPath, ".m3u8")
+        && parse_hls_blocking_request(request.query, hlsPosition))
+    {
+        // A segment that far ahead is not made within the wait
+        std::string playlist;
+        if (file->size <= sMaxCheckedPlaylistSize && read_all(file->fd, file->size, playlist)
+            && hls_request_too_far(playlist, hlsPosition))
+        {
+            log_http_error(BAD_REQUEST, "_HLS_msn more than two segments ahead", fileName, connectionId);
+            set_error_response(BAD_REQUEST, connection);
+            return;
+        }
+
+        RLOG(rlog::Verbose, connectionId << ": SEND blocking reload " << fileName << " => " << file->internalPath);
+        ProducedBody playlistBody;
+        playlistBody.mimeType = file->mimeType;
+        playlistBody.priority = file->priority;
+        playlistBody.producer = [this, file, hlsPosition]()
+        {
+            return mTailFollower->waitForPlaylist(file->internalPath, hlsPosition);
+        };
+        produceResponse(playlistBody, connection);
+        return;
+    }
+
+    RLOG(rlog::Verbose, connectionId << ": SEND " << fileName << " => " << file->internalPath);
+    len = (long)file->size;
+    const std::string& mimeType = file->mimeType;
+
+    // The event loop sends the file when the socket is ready
+    connection.bodyFile = file;
+    connection.bodyFD = file->fd;
+    connection.bodyOffset = 0;
+    connection.bodyRemaining = len;
+    connection.keepAlive = wants_keep_alive(request);
+    connection.priority = file->priority;
+
+    // Text files to clients that accept gzip. Ranges are served from the plain file
+    bool gzip = file->compressible && request.header("Range").empty()
+                && accepts_gzip(request.header("Accept-Encoding"))
+                && !gzip_body(*file).empty();
+
+    // Players poll live playlists. Unchanged files are not sent again
+    if (is_not_modified(request, *file, gzip))
+    {
+        set_not_modified_response(*file, gzip, connection);
+        RLOG(rlog::Debug, connectionId << ": NET Response Headers:\n" << connection.responseHead);
+        return;
+    }
+
+    if (!gzip && request.header("Range").empty() && request.header("Origin").empty())
+    {
+        // Most requests. Whole file with the pre-rendered head
+        connection.responseHead = connection.keepAlive ? file->responseHeadKeepAlive
+                                                       : file->responseHeadClose;
+        if (file->faststart)
+        {
+            use_faststart_layout(connection);
+        }
+        RLOG(rlog::Debug, connectionId << ": NET Response Headers:\n" << connection.responseHead);
+        return;
+    }
+
+    std::string originResponse = origin_headers(request);
+
+    if (gzip)
+    {
+        connection.closeBody();
+        RWebBodyPart compressed;
+        compressed.sharedData = file->gzipBody;
+        compressed.sharedOwner = file;
+        connection.bodyParts.push_back(std::move(compressed));
+        connection.responseHead = render_response_head("200 OK", file->gzipBody.size(),
+                                                       cache_headers(*file, true) + "Content-Encoding: gzip\n"
+                                                       + originResponse,
+                                                       connection.keepAlive, mimeType);
+        RLOG(rlog::Debug, connectionId << ": NET Response Headers:\n" << connection.responseHead);
+        return;
+    }
+
+    std::vector<ByteRange> ranges;
+    RangeParseResult rangeResult = parse_range_header(std::string(request.header("Range")), len, ranges);
+
+    if (rangeResult == RangeParseResult::Unsatisfiable)
+    {
+        log_http_error(RANGE_NOT_SATISFIABLE, "range not satisfiable", std::string(request.header("Range")), connectionId);
+        connection.closeBody();
+        connection.keepAlive = false;
+        set_range_not_satisfiable_response(len, connection);
+        return;
+    }
+
+    const char* status = "200 OK";
+    std::string rangeResponse = "";
+    std::string contentType = mimeType;
+    long contentLength = len;
+
+    if (rangeResult == RangeParseResult::Satisfiable && ranges.size() == 1)
+    {
+        status = "206 Partial Content";
+        rangeResponse = content_range_header(ranges[0], len);
+        contentLength = ranges[0].last - ranges[0].first + 1;
+        connection.bodyOffset = ranges[0].first;
+        connection.bodyRemaining = contentLength;
+    }
+    else if (rangeResult == RangeParseResult::Satisfiable)
+    {
+        // multipart/byteranges body. Each range gets its own part header
+        status = "206 Partial Content";
+        contentType = std::string("multipart/byteranges; boundary=") + BYTERANGES_BOUNDARY;
+        contentLength = 0;
+        connection.bodyRemaining = 0;
+
+        for (const ByteRange& range : ranges)
+        {
+            RWebBodyPart partHeader;
+            partHeader.data = std::string("\r\n--") + BYTERANGES_BOUNDARY + "\r\n"
+                            + "Content-Type: " + mimeType + "\r\n"
+                            + content_range_header(range, len, "\r\n")
+                            + "\r\n";
+            contentLength += partHeader.data.size();
+            connection.bodyParts.push_back(partHeader);
+
+            RWebBodyPart fileRange;
+            fileRange.fileOffset = range.first;
+            fileRange.fileLength = range.last - range.first + 1;
+            contentLength += fileRange.fileLength;
+            connection.bodyParts.push_back(fileRange);
+        }
+
+        RWebBodyPart lastBoundary;
+        lastBoundary.data = std::string("\r\n--") + BYTERANGES_BOUNDARY + "--\r\n";
+        contentLength += lastBoundary.data.size();
+        connection.bodyParts.push_back(lastBoundary);
+    }
+
+    connection.responseHead = render_response_head(status, contentLength,
+                                                   cache_headers(*file, false) + rangeResponse + originResponse,
+                                                   connection.keepAlive, contentType);
+    if (file->faststart)
+    {
+        use_faststart_layout(connection);
+    }
+    RLOG(rlog::Debug, connectionId << ": NET Response Headers:\n" << connection.responseHead);
+}
+
+// Body made while it is sent, so there is no length, range or validator.
+// HEAD gets the headers without starting the producer
+void
+RWeb::produceResponse(const ProducedBody& body, RWebConnection& connection)
+{
+    int connectionId = connection.connectionId;
+    const RWebRequest& request = connection.request;
+
+    // HTTP/1.0 clients get the body until the connection is closed
+    bool chunked = request.versionMajor > 1 || (request.versionMajor == 1 && request.versionMinor >= 1);
+
+    if (!equals_ignore_case(request.method, "HEAD"))
+    {
+        int fd = body.producer();
+        if (fd < 0)
+        {
+            log_http_error(NOTFOUND, "body producer failed", std::string(request.path), connectionId);
+            set_error_response(NOTFOUND,connection);
+            return;
+        }
+        connection.bodyFD = fd;
+        connection.bodyOffset = 0;
+        connection.bodyRemaining = std::numeric_limits<off_t>::max();
+        connection.bodyUntilEnd = true;
+        connection.bodyChunked = chunked;
+    }
+
+    RLOG(rlog::Verbose, connectionId << ": SEND produced body " << request.path);
+    connection.keepAlive = chunked && wants_keep_alive(request);
+    connection.priority = body.priority;
+    connection.responseHead = std::string("HTTP/1.1 200 OK\nServer: rweb/") + std::to_string(VERSION) + ".0\n"
+                              + (chunked ? "Transfer-Encoding: chunked\n" : "")
+                              + "Cache-Control: no-store\n"
+                              + connection_header(connection.keepAlive)
+                              + "Content-Type: " + body.mimeType + "\n\n";
+    RLOG(rlog::Debug, connectionId << ": NET Response Headers:\n" << connection.responseHead);
+}
+
+// Follow the file a writer is writing for fileName. Returns false if
+// the file is not growing, or is complete by the time it is opened
+bool
+RWeb::growingResponse(const std::string& fileName, RWebConnection& connection)
+{
+    int connectionId = connection.connectionId;
+
+    std::string internalFileName = getInternalPath(fileName);
+    if (internalFileName.empty()) { return false; }
+
+    std::string writtenFileName = mTailFollower->growingFile(internalFileName);
+    if (writtenFileName.empty()) { return false; }
+
+    std::string mimeType(extension_to_mime_type(internalFileName));
+    if (mimeType.empty()) { return false; }
+
+    // A renamed file is followed from its temporary name. The open file
+    // stays the same when it gets its final name. Closed with the producer
+    auto written = std::make_shared<RWebCachedFile>();
+    written->internalPath = internalFileName;
+    written->fd = open(writtenFileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (written->fd < 0) { return false; }
+
+    struct stat fileStat = {};
+    fstat(written->fd, &fileStat);
+
+    RLOG(rlog::Verbose, connectionId << ": SEND growing " << fileName << " => " << writtenFileName);
+    ProducedBody growingBody;
+    growingBody.mimeType = mimeType;
+    growingBody.priority = response_priority(mimeType, fileStat.st_size);
+    growingBody.producer = [this, written]()
+    {
+        return mTailFollower->follow(written->internalPath, written->fd);
+    };
+    produceResponse(growingBody, connection);
+    return true;
+}
+
+// HLS presentation of an MP4 file, made from its sample tables. Only the
+// index is cached. Playlist and moof boxes are made for each request,
+// the samples are sent from the file
+void
+RWeb::mp4HlsResponse(const std::string& mp4Path, Mp4HlsResource resource, std::size_t segmentIndex,
+                     RWebConnection& connection)
+{
+    int connectionId = connection.connectionId;
+    const RWebRequest& request = connection.request;
+
+    RWebFileCache::FilePtr file;
+    if (mFileCache)
+    {
+        file = mFileCache->get(mp4Path);
+    }
+    if (!file)
+    {
+        file = openFile(mp4Path, connection);
+        if (!file) { return; }
+    }
+
+    RWebMp4IndexCache::IndexPtr index = mMp4IndexCache->get(*file);
+    if (!index || (resource == mh_MediaSegment && segmentIndex >= index->segmentCount()))
+    {
+        log_http_error(NOTFOUND, "no HLS of file", std::string(request.path), connectionId);
+        set_error_response(NOTFOUND,connection);
+        return;
+    }
+
+    RLOG(rlog::Verbose, connectionId << ": SEND HLS " << request.path << " => " << file->internalPath);
+    connection.keepAlive = wants_keep_alive(request);
+    off_t contentLength = 0;
+    RWebBodyPart part;
+
+    switch (resource)
+    {
+    case mh_Playlist:
+        part.data = index->playlist(split(mp4Path, '/').back());
+        contentLength = part.data.size();
+        connection.bodyParts.push_back(std::move(part));
+        connection.priority = pr_Manifest;
+        break;
+
+    case mh_InitSegment:
+        part.sharedData = index->initSegment();
+        part.sharedOwner = index;
+        contentLength = part.sharedData.size();
+        connection.bodyParts.push_back(std::move(part));
+        connection.priority = pr_InitSegment;
+        break;
+
+    case mh_MediaSegment:
+        connection.bodyFile = file;
+        connection.bodyFD = file->fd;
+        contentLength = index->appendMediaSegment(segmentIndex, connection.bodyParts);
+        connection.priority = pr_MediaSegment;
+        break;
+    }
+
+    connection.responseHead = render_response_head("200 OK", contentLength, origin_headers(request),
+                                                   connection.keepAlive,
+                                                   std::string(extension_to_mime_type(request.path)));
+    RLOG(rlog::Debug, connectionId << ": NET Response Headers:\n" << connection.responseHead);
+}
+
+// Resolve public path, open the file and create cache entry with the
+// metadata and pre-rendered headers. Sets error response on failure.
+std::shared_ptr<RWebCachedFile>
+RWeb::openFile(const std::string& fileName, RWebConnection& connection)
+{
+    int connectionId = connection.connectionId;
+
     std::string internalFileName = getInternalPath(fileName);
     if (internalFileName == "")
     {
         log_http_error(NOTFOUND, "failed get internal path", fileName, connectionId);
-        send_error_response(NOTFOUND,fd);
-        return;
+        set_error_response(NOTFOUND,connection);
+        return nullptr;
     }
 
-    std::string mimeType = extension_to_mime_type(internalFileName);
+    std::string mimeType(extension_to_mime_type(internalFileName));
 
     if (mimeType == "")
     {
         log_http_error(FORBIDDEN,"file extension type not supported", internalFileName, connectionId);
-        send_error_response(FORBIDDEN,fd);
-        return;
+        set_error_response(FORBIDDEN,connection);
+        return nullptr;
     }
 
-    if (( file_fd = open(internalFileName.c_str(),O_RDONLY)) == -1)  // open the file for reading
+    auto file = std::make_shared<RWebCachedFile>();
+    if (( file->fd = open(internalFileName.c_str(),O_RDONLY | O_CLOEXEC)) == -1)  // open the file for reading
     {
         log_http_error(NOTFOUND, "failed to open file", internalFileName, connectionId);
-        send_error_response(NOTFOUND,fd);
-        return;
+        set_error_response(NOTFOUND,connection);
+        return nullptr;
     }
 
-    RLOG_N(connectionId << ": SEND " << fileName << " => " << internalFileName);
-    len = (long)lseek(file_fd, (off_t)0, SEEK_END); // lseek to the file end to find the length
-    lseek(file_fd, (off_t)0, SEEK_SET); // lseek back to the file start ready for reading
+    struct stat fileStat = {};
+    if (fstat(file->fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+    {
+        log_http_error(NOTFOUND, "not a regular file", internalFileName, connectionId);
+        set_error_response(NOTFOUND,connection);
+        return nullptr;
+    }
 
-    std::string originUrl = get_origin_header_url(buffer);
-    std::string originResponse = "";
-    if (originUrl.size() != 0)
+    // Only the top level box headers are read of MP4 files with moov first
+    if (mMp4Faststart && mimeType == "video/mp4")
     {
-        originResponse = "Access-Control-Allow-Origin: " + originUrl + "\n"
-                        + "Vary: Origin\n";
+        file->faststart = RWebMp4Faststart::create(file->fd, fileStat.st_size);
     }
 
-    sprintf(buffer.data(), "HTTP/1.1 200 OK\nServer: rweb/%d.0\n"
-                           "Content-Length: %ld\n"
-                           "%s" // origin response
-                           "Connection: close\n"
-                           "Content-Type: %s\n\n", VERSION, len, originResponse.c_str(), mimeType.c_str()); // Headers + a blank line 
-//     sprintf(buffer,"HTTP/1.1 200 OK\nServer: rweb/%d.0\nConnection: close\nContent-Type: %s\n\n", VERSION, mimeType.c_str()); // Headers + a blank line
+    file->publicPath = fileName;
+    file->internalPath = internalFileName;
+    file->size = fileStat.st_size;
+    file->mtime = fileStat.st_mtime;
+    file->mtimeNanoseconds = fileStat.st_mtim.tv_nsec;
+    file->inode = fileStat.st_ino;
+    file->mimeType = mimeType;
+    file->priority = response_priority(mimeType, file->size);
 
-    RLOG_NETWORK(connectionId << ": NET Response Headers:\n" << buffer.c_str());
-    send(fd, buffer.data(), strlen(buffer.c_str()), MSG_NOSIGNAL);
+    // Changes when the file is replaced or rewritten, also within the same second.
+    // The faststart layout is another representation of the file
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx.%lx%s\"", (unsigned long)file->inode, (unsigned long)file->size,
+             (unsigned long)file->mtime, (unsigned long)file->mtimeNanoseconds, file->faststart ? "-fs" : "");
+    file->etag = etag;
+    file->gzipEtag = file->etag.substr(0, file->etag.size() - 1) + "-gz\"";
+    file->lastModified = format_http_date(file->mtime);
+    file->compressible = is_compressible_mime_type(mimeType);
 
-    // send file in 8KB block - last block may be smaller
-    while ( (ret = read(file_fd, buffer.data(), BUFSIZE)) > 0 )
+    std::string validators = cache_headers(*file, false);
+    file->responseHeadKeepAlive = render_response_head("200 OK", file->size, validators, true, mimeType);
+    file->responseHeadClose = render_response_head("200 OK", file->size, validators, false, mimeType);
+
+    if (mFileCache)
     {
-//         write(fd, buffer.data(), ret);
-        ret = send(fd, buffer.data(), ret, MSG_NOSIGNAL);
-        if (ret == -1) { break; }   // Something went wrong, so we can stop trying to send
+        mFileCache->put(file);
     }
-    RLOG_N(connectionId << ": SEND Finished");
-    sleep(1);    // allow socket to drain before signalling the socket is closed
-    close(file_fd);
-    close(fd);
+
+    return file;
+}
+
+
+// IPv6 socket that also accepts IPv4 clients, so devices on IPv6 only
+// networks can connect. Plain IPv4 if IPv6 is disabled on this host.
+// Returns listening socket, or -1
+int
+RWeb::createListenSocket(bool reusePort)
+{
+    int listenFD = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ipv6 = (listenFD >= 0);
+    if (!ipv6)
+    {
+        listenFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (listenFD < 0)
+    {
+        log_error("socket create");
+        return -1;
+    }
+
+    int on = 1;
+    int off = 0;
+    setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reusePort && setsockopt(listenFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        log_error("socket SO_REUSEPORT");
+        close(listenFD);
+        return -1;
+    }
+
+    int ret;
+    if (ipv6)
+    {
+        setsockopt(listenFD, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+        struct sockaddr_in6 serverAddr = {};
+        serverAddr.sin6_family = AF_INET6;
+        serverAddr.sin6_addr = in6addr_any;
+        serverAddr.sin6_port = htons(mPort);
+        ret = bind(listenFD, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+    }
+    else
+    {
+        struct sockaddr_in serverAddr = {};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        serverAddr.sin_port = htons(mPort);
+        ret = bind(listenFD, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+    }
+
+    if (ret < 0)
+    {
+        log_error("socket bind");
+        close(listenFD);
+        return -1;
+    }
+    apply_listen_socket_options(listenFD, mSocketOptions);
+
+    if (listen(listenFD, sListenBacklog) <0)
+    {
+        log_error("socket listen");
+        close(listenFD);
+        return -1;
+    }
+
+    return listenFD;
 }
 
 
@@ -256,6 +957,11 @@ RWeb::RWeb(const std::string& rootDir, int port)
   : mRootDir(rootDir), 
     mPort(port)
 {
+    // Filter paths are resolved with the root dir, so it must be final here
+    if (mRootDir == ".")
+    {
+        mRootDir = std::filesystem::current_path();
+    }
 }
 
 RWeb::~RWeb()
@@ -272,11 +978,6 @@ RWeb::start()
         RLOG(rlog::Critical, "Error: root directory not specified");
         return false;
     }
-    if (mRootDir == ".")
-    {
-        mRootDir = std::filesystem::current_path();
-    }
-
     if (mRootDir == "/"
       || mRootDir.substr(0,5) == "/sbin"
       || found_in({"/bin","/dev","/etb","/lib","/usr"}, mRootDir.substr(0,4)))
@@ -299,35 +1000,109 @@ RWeb::start()
 
     RLOG_N("rweb starting. Port: " << mPort << ", root dir: " << mRootDir);
 
-    // setup the listen socket
-    if ((mListenFD = socket(AF_INET, SOCK_STREAM,0)) <0)
+    int listenerCount = mListenerCount;
+    if (listenerCount <= 0)
     {
-        log_error("socket create");
-        return false;
+        listenerCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // With several listeners the kernel spreads new connections over
+    // them. Each listener has its own loop, so accept scales with cores.
+    for (int i=0; i<listenerCount; ++i)
+    {
+        int listenFD = createListenSocket(listenerCount > 1);
+        if (listenFD < 0)
+        {
+            stop();
+            return false;
+        }
+        mListenFDs.push_back(listenFD);
     }
 
-    struct sockaddr_in serverAddr = {};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serverAddr.sin_port = htons(mPort);
+    if (mWorkerThreads > 0)
+    {
+        mWorkerPool = std::make_unique<RWebWorkerPool>(mWorkerThreads, mMaxQueuedRequests);
+        mWorkerPool->start();
+    }
+    mClientLimiter = std::make_unique<RWebClientLimiter>(mMaxConnectionsPerClient);
+    if (mFileCacheSize > 0)
+    {
+        mFileCache = std::make_unique<RWebFileCache>(mFileCacheSize);
+    }
+    if (mBlockCacheSize > 0)
+    {
+        mBlockCache = std::make_unique<RWebBlockCache>(mBlockCacheSize);
+    }
+    if (mTailFollow)
+    {
+        mTailFollower = std::make_unique<RWebTailFollower>(mRootDir);
+        if (!mTailFollower->start())
+        {
+            mTailFollower.reset();
+        }
+    }
+    if (mMp4Hls)
+    {
+        mMp4IndexCache = std::make_unique<RWebMp4IndexCache>(sMp4IndexCacheSize);
+    }
 
-    if (bind(mListenFD, (struct sockaddr *)&serverAddr,sizeof(serverAddr)) <0)
+    // One line per response, written by a background thread
+    if (rlog::logLevel >= rlog::Normal || rlog::networkLogEnabled)
     {
-        log_error("socket bind");
-        return false;
+        mAccessLog = std::make_unique<RWebAccessLog>(sAccessLogSize);
+        mAccessLog->start();
     }
-    if (listen(mListenFD,64) <0)
+    if (mTotalPacingRate > 0)
     {
-        log_error("socket listen");
-        return false;
+        mTotalPacer = std::make_unique<RWebTokenBucket>(mTotalPacingRate);
     }
 
-    mServerState = ss_Running;
-    std::thread(
-        [=](){
-            this->serverLoop();
+    RWebLoop::RequestHandler requestHandler =
+        [this](RWebConnection& connection){
+            this->handleRequest(connection);
+        };
+
+    unsigned cpuCount = std::max(1u, std::thread::hardware_concurrency());
+    bool useUring = (mIoBackend == io_Uring);
+    for (std::size_t i=0; i<mListenFDs.size(); ++i)
+    {
+        std::unique_ptr<RWebLoop> loop;
+        if (useUring)
+        {
+            loop = std::make_unique<RWebUringLoop>(mListenFDs[i], requestHandler,
+                                                   mWorkerPool.get(), mClientLimiter.get());
+        }
+        else
+        {
+            loop = std::make_unique<RWebEventLoop>(mListenFDs[i], requestHandler,
+                                                   mWorkerPool.get(), mClientLimiter.get());
         }
-    ).detach();
+        if (mListenFDs.size() > 1)
+        {
+            loop->setCpu(i % cpuCount);
+        }
+        loop->setAccessLog(mAccessLog.get());
+        loop->setSocketOptions(mSocketOptions);
+        loop->setPacing(mConnectionPacingRate, mTotalPacer.get());
+
+        if (!loop->start())
+        {
+            if (useUring)
+            {
+                RLOG(rlog::Important, "RWeb: io_uring not available. Using epoll");
+                useUring = false;
+                --i;    // Same listener again
+                continue;
+            }
+            stop();
+            return false;
+        }
+        mEventLoops.push_back(std::move(loop));
+    }
+
+    RLOG_N("rweb started " << mEventLoops.size() << " listener(s), "
+           << (useUring ? "io_uring" : "epoll"));
+    mServerState = ss_Running;
 
     return true;
 }
@@ -338,100 +1113,231 @@ RWeb::stop()
     if (mServerState == ss_Finished){ return; }
 
     RLOG_N("RWeb stopping...");
-    if (mServerState == ss_Running)
+    mServerState = ss_Stopping;
+
+    // Stop workers first. The event loop closes connections the workers use
+    if (mWorkerPool)
     {
-        mServerState = ss_Stopping;
-        while(mServerState != ss_Finished)
-        {
-            usleep(1000);
-        }
+        mWorkerPool->stop();
     }
-    else
+    // Followed files and held playlist reloads get their end, so the loops
+    // do not wait for them. The object is used by the loops until they stop
+    if (mTailFollower)
     {
-        mServerState = ss_Finished;
+        mTailFollower->stop();
     }
+    for (auto& loop : mEventLoops)
+    {
+        loop->stop();
+    }
+    mEventLoops.clear();
+    mFileCache.reset();
+    mBlockCache.reset();
+    mMp4IndexCache.reset();
+    mTailFollower.reset();
+    mAccessLog.reset();     // Writes the last records
+    mTotalPacer.reset();
+    mServerState = ss_Finished;
 
-    close(mListenFD);
+    for (int listenFD : mListenFDs)
+    {
+        close(listenFD);
+    }
+    mListenFDs.clear();
 
     RLOG_N("RWeb stopped");
 }
 
 void
-RWeb::setFilter(const std::vector<PathFilterItem>& filter )
+RWeb::setWorkerPool(int threadCount, std::size_t maxQueueSize)
+{
+    mWorkerThreads = threadCount;
+    mMaxQueuedRequests = maxQueueSize;
+}
+
+void
+RWeb::setMaxConnectionsPerClient(int maxConnections)
 {
-    mFilter = filter;
+    mMaxConnectionsPerClient = maxConnections;
 }
 
 void
-RWeb::serverLoop()
+RWeb::prefetch(const std::string& urlPath)
 {
-    int connectionId = 0;
-    RLOG(rlog::Verbose, "Server loop start");
-    RLOG(rlog::Verbose, "Waiting for connection #" << connectionId);
-    while (mServerState == ss_Running)
+    if (mServerState != ss_Running) { return; }
+
+    std::string publicPath = (!urlPath.empty() && urlPath[0] == '/') ? urlPath : "/" + urlPath;
+    char normalizedPath[RWebRequest::sMaxPathLength];
+    std::size_t length = normalize_path(publicPath, normalizedPath, sizeof(normalizedPath));
+    if (length == 0) { return; }
+
+    // The HLS presentation of an MP4 file is made from the file
+    std::string path(normalizedPath, length);
+    std::string mp4Path;
+    Mp4HlsResource hlsResource;
+    std::size_t segmentIndex = 0;
+    if (parse_mp4_hls_path(path, mp4Path, hlsResource, segmentIndex))
     {
-        struct pollfd pollEvents = {mListenFD, 0xFF, 0};
-        if (poll(&pollEvents, 1, 10) == 0)
-        {
-            continue;
-        }
+        path = mp4Path;
+    }
+
+    std::string internalPath = getInternalPath(path);
+    if (internalPath == "") { return; }
+
+    // Opening a file on a network share may also be slow,
+    // so only the event loop thread is not blocked without workers
+    auto job = [internalPath]()
+    {
+        read_ahead(internalPath);
+    };
+    if (mWorkerPool)
+    {
+        mWorkerPool->submit(job);   // Skipped when the server is busy
+    }
+    else
+    {
+        job();
+    }
+}
+
+void
+RWeb::setMp4Faststart(bool enabled)
+{
+    mMp4Faststart = enabled;
+}
+
+void
+RWeb::setMp4Hls(bool enabled)
+{
+    mMp4Hls = enabled;
+}
+
+void
+RWeb::setBlockCacheSize(std::size_t maxBytes)
+{
+    mBlockCacheSize = maxBytes;
+}
+
+void
+RWeb::setMetricsPath(const std::string& path)
+{
+    mMetricsPath = path;
+}
+
+void
+RWeb::setSocketOptions(const RWebSocketOptions& options)
+{
+    mSocketOptions = options;
+}
+
+void
+RWeb::setPacing(uint64_t connectionBytesPerSecond, uint64_t totalBytesPerSecond)
+{
+    mConnectionPacingRate = connectionBytesPerSecond;
+    mTotalPacingRate = totalBytesPerSecond;
+}
+
+void
+RWeb::setListenerCount(int count)
+{
+    mListenerCount = count;
+}
+
+void
+RWeb::setIoBackend(IoBackend backend)
+{
+    mIoBackend = backend;
+}
+
+void
+RWeb::setFileCacheSize(std::size_t maxEntries)
+{
+    mFileCacheSize = maxEntries;
+}
+
+RWebWorkerPoolStats
+RWeb::workerPoolStats()
+{
+    if (!mWorkerPool) { return RWebWorkerPoolStats(); }
+
+    return mWorkerPool->stats();
+}
+
+void
+RWeb::addBodyProducer(const std::string& urlPath, RWebBodyProducer producer)
+{
+    std::string publicPath = (!urlPath.empty() && urlPath[0] == '/') ? urlPath : "/" + urlPath;
+    char normalizedPath[RWebRequest::sMaxPathLength];
+    std::size_t length = normalize_path(publicPath, normalizedPath, sizeof(normalizedPath));
+    std::string mimeType(extension_to_mime_type(publicPath));
+    if (length == 0 || mimeType.empty())
+    {
+        RLOG(rlog::Critical, "RWeb: Invalid body producer path " << urlPath);
+        return;
+    }
+
+    mBodyProducers[std::string(normalizedPath, length)] = {std::move(producer), mimeType};
+}
+
+void
+RWeb::setTailFollow(bool enabled)
+{
+    mTailFollow = enabled;
+}
 
-        struct sockaddr_in clientAddr = {};
-        int socketfd;
-        socklen_t length = sizeof(clientAddr);
+void
+RWeb::setFilter(const std::vector<PathFilterItem>& filter )
+{
+    std::shared_ptr<FilterIndex> index;
+    if (!filter.empty())
+    {
+        index = std::make_shared<FilterIndex>();
+        index->reserve(filter.size());
+    }
 
-        if ((socketfd = accept(mListenFD, (struct sockaddr *)&clientAddr, &length)) < 0)
+    // Request paths are decoded and normalized by the request parser.
+    // Do the same with the filter so they can be compared directly.
+    // item.publicPath may skip leading slash, and may be url encoded
+    char normalizedPath[RWebRequest::sMaxPathLength];
+    for (const PathFilterItem& item : filter)
+    {
+        std::string publicPath = (item.publicPath[0] == '/') ? item.publicPath : "/" + item.publicPath;
+        std::size_t length = normalize_path(publicPath, normalizedPath, sizeof(normalizedPath));
+        if (length == 0)
         {
-            log_error("socket accept");
-            return;
+            RLOG(rlog::Critical, "RWeb: Invalid filter path " << item.publicPath);
+            continue;
         }
 
+        std::string internalPath = (item.internalPath[0] == '/') ? item.internalPath       // Absolute path
+                                                                 : mRootDir + "/" + item.internalPath;
+        RLOG(rlog::Debug, "RWeb filter " << std::string(normalizedPath, length) << " => " << internalPath);
+        (*index)[std::string(normalizedPath, length)] = internalPath;
+    }
 
-        std::thread(
-            [=](){
-                handleRequest(socketfd,connectionId); 
-                return 0;
-            }
-        ).detach();
+    std::atomic_store(&mFilterIndex, std::shared_ptr<const FilterIndex>(index));
 
-        ++connectionId;
-        RLOG(rlog::Verbose, "Waiting for connection #" << connectionId);
+    if (mFileCache)
+    {
+        mFileCache->clear();    // Public paths may map to other files now
     }
-    mServerState = ss_Finished;
-    RLOG(rlog::Verbose, "Server loop finished");
 }
 
 std::string
 RWeb::getInternalPath(const std::string& publicPath)
 {
-    if (mFilter.size() == 0)
+    std::shared_ptr<const FilterIndex> index = std::atomic_load(&mFilterIndex);
+    if (!index)
     {
         return mRootDir + "/" + publicPath;
     }
 
-    RLOG(rlog::Debug, "getInternalPath " << publicPath);
-    for (auto item : mFilter)
+    // Both paths are normalized, with leading slash
+    auto found = index->find(publicPath);
+    if (found == index->end())
     {
-        RLOG(rlog::Debug, "  publicPath " << item.publicPath);
-
-        // Match with and without leading slash
-        // publicPath should contain leading slash.
-        // item.publicPath may skip leading slash   
-        if (publicPath == item.publicPath ||
-            publicPath.substr(1) == item.publicPath)
-        {
-            if (item.internalPath[0] == '/')    // Absolute path
-            {
-                RLOG(rlog::Debug, "    match: internalPath " << item.internalPath);
-                return item.internalPath;
-            }
-            else    // relative path
-            {
-                RLOG(rlog::Debug, "    match: internalPath " << item.internalPath);
-                return mRootDir + "/" + item.internalPath;
-            }
-        }
+        return "";
     }
 
-    return "";
+    return found->second;
 }
@@ -0,0 +1,237 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebAccessLog.h"
+#include "rweb/RWebConnection.h"
+
+// Time the writer sleeps when the ring is empty
+static constexpr std::chrono::milliseconds sWriteInterval{50};
+static constexpr std::size_t sMaxBatchSize = 64*1024;
+
+// Copy and truncate. Control characters and quotes would break the log line
+template <std::size_t N>
+static void copy_field(char (&field)[N], std::string_view value)
+{
+    std::size_t length = std::min(value.size(), N - 1);
+    for (std::size_t i=0; i<length; ++i)
+    {
+        char c = value[i];
+        field[i] = ((unsigned char)c < 0x20 || c == '"' || c == 0x7f) ? '?' : c;
+    }
+    field[length] = '\0';
+}
+
+static void append_record(std::string& output, const RWebAccessRecord& record)
+{
+    using namespace std::chrono;
+
+    time_t seconds = system_clock::to_time_t(record.finishTime);
+    int milliseconds = duration_cast<std::chrono::milliseconds>(
+                           record.finishTime.time_since_epoch()).count() % 1000;
+    struct tm utcTime;
+    gmtime_r(&seconds, &utcTime);
+
+    char line[512];
+    std::size_t length = strftime(line, sizeof(line), "ACCESS %Y-%m-%dT%H:%M:%S", &utcTime);
+    snprintf(line + length, sizeof(line) - length, ".%03dZ %s #%d \"%s %s\" %d %llu %uus %s\n",
+             milliseconds, record.clientAddress, record.connectionId,
+             record.method, record.path, record.status,
+             (unsigned long long)record.bytesSent, record.durationMicroseconds,
+             record.range[0] ? record.range : "-");
+    output += line;
+}
+
+
+RWebAccessLog::RWebAccessLog(std::size_t capacity)
+{
+    std::size_t size = 2;
+    while (size < capacity) { size *= 2; }
+
+    mSlots = std::make_unique<Slot[]>(size);
+    mMask = size - 1;
+    for (std::size_t i=0; i<size; ++i)
+    {
+        mSlots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+RWebAccessLog::~RWebAccessLog()
+{
+    stop();
+}
+
+void
+RWebAccessLog::start()
+{
+    if (mThread.joinable()) { return; }
+
+    mRunning = true;
+    mThread = std::thread(
+        [this](){
+            this->writerLoop();
+        }
+    );
+}
+
+void
+RWebAccessLog::stop()
+{
+    if (!mThread.joinable()) { return; }
+
+    mRunning = false;
+    mThread.join();
+}
+
+void
+RWebAccessLog::beginRecord(RWebConnection& connection)
+{
+    RWebAccessRecord& record = connection.accessRecord;
+    const RWebRequest& request = connection.request;
+
+    record.connectionId = connection.connectionId;
+    copy_field(record.clientAddress, connection.clientAddress);
+    if (request.badRequest)
+    {
+        // Request fields may not be set
+        copy_field(record.method, "-");
+        copy_field(record.path, "-");
+        copy_field(record.range, "");
+    }
+    else
+    {
+        copy_field(record.method, request.method);
+        copy_field(record.path, request.path);
+        copy_field(record.range, request.header("Range"));
+    }
+
+    // "HTTP/1.1 200 OK"
+    const std::string& head = connection.responseHead;
+    record.status = (head.size() > 9) ? atoi(head.c_str() + 9) : 0;
+}
+
+void
+RWebAccessLog::finishRecord(RWebConnection& connection)
+{
+    RWebAccessRecord& record = connection.accessRecord;
+    if (record.status == 0) { return; }
+
+    record.durationMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - connection.requestStart).count();
+    record.finishTime = std::chrono::system_clock::now();
+    record.bytesSent = connection.responseHeadSent + connection.bytesSentZeroCopy
+                       + connection.bytesSentCopied;
+
+    if (!push(record))
+    {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        mDroppedMetric.add();
+    }
+    record.status = 0;
+}
+
+// Bounded multi-producer queue. Each slot has a sequence number that tells
+// if it is free for the producer at that position, or has a record for
+// the consumer. Producers only compete for the enqueue position.
+bool
+RWebAccessLog::push(const RWebAccessRecord& record)
+{
+    uint64_t position = mEnqueuePosition.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Slot& slot = mSlots[position & mMask];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        int64_t difference = (int64_t)(sequence - position);
+
+        if (difference == 0)
+        {
+            if (mEnqueuePosition.compare_exchange_weak(position, position + 1,
+                                                       std::memory_order_relaxed))
+            {
+                slot.record = record;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false;   // Full
+        }
+        else
+        {
+            position = mEnqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool
+RWebAccessLog::pop(RWebAccessRecord& record)
+{
+    Slot& slot = mSlots[mDequeuePosition & mMask];
+    if (slot.sequence.load(std::memory_order_acquire) != mDequeuePosition + 1)
+    {
+        return false;   // Empty, or producer still copying
+    }
+
+    record = slot.record;
+    slot.sequence.store(mDequeuePosition + mMask + 1, std::memory_order_release);
+    ++mDequeuePosition;
+    return true;
+}
+
+void
+RWebAccessLog::writerLoop()
+{
+    std::string batch;
+    uint64_t reportedDropped = 0;
+
+    while (true)
+    {
+        bool running = mRunning;
+
+        RWebAccessRecord record;
+        while (batch.size() < sMaxBatchSize && pop(record))
+        {
+            append_record(batch, record);
+        }
+
+        uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (dropped != reportedDropped)
+        {
+            batch += "ACCESS log full. Dropped " + std::to_string(dropped - reportedDropped) + " records\n";
+            reportedDropped = dropped;
+        }
+
+        if (!batch.empty())
+        {
+            // One write and flush for all records since last time
+            *rlog::logStream << batch << std::flush;
+            batch.clear();
+            continue;
+        }
+
+        if (!running) { break; }
+        std::this_thread::sleep_for(sWriteInterval);
+    }
+}
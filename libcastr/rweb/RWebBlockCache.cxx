@@ -0,0 +1,183 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebBlockCache.h"
+
+// Blocks this close to the start or end of a file are always cached.
+// The head has ftyp and often moov, the tail has moov or the index.
+static const off_t sHotSize = 1024*1024;
+
+// Ranges up to this size are cached completely. Seeks, moov reads and
+// segments are short. Progressive playback reads the rest of the file.
+static const off_t sMaxShortRange = 4*1024*1024;
+
+
+static bool read_block(int fd, off_t offset, std::string& data)
+{
+    std::size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t ret = pread(fd, &data[done], data.size() - done, offset + done);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret <= 0) { return false; }
+        done += ret;
+    }
+    return true;
+}
+
+
+RWebBlockCache::RWebBlockCache(std::size_t maxBytes)
+  : mMaxBytes(maxBytes)
+{
+}
+
+void
+RWebBlockCache::appendRange(const RWebCachedFile& file, off_t offset, off_t length,
+                            std::deque<RWebBodyPart>& parts)
+{
+    bool shortRange = length <= sMaxShortRange;
+    off_t end = offset + length;
+
+    while (offset < end)
+    {
+        off_t blockIndex = offset / sBlockSize;
+        off_t blockStart = blockIndex * sBlockSize;
+        off_t partEnd = std::min(end, blockStart + sBlockSize);
+
+        BlockPtr block;
+        if (shortRange || blockStart < sHotSize || blockStart + sBlockSize > file.size - sHotSize)
+        {
+            block = get(file, blockIndex);
+        }
+
+        if (block)
+        {
+            RWebBodyPart part;
+            part.sharedData = std::string_view(block->data).substr(offset - blockStart, partEnd - offset);
+            part.sharedOwner = std::move(block);
+            parts.push_back(std::move(part));
+        }
+        else if (!parts.empty() && parts.back().fileLength > 0
+                 && parts.back().fileOffset + parts.back().fileLength == offset)
+        {
+            parts.back().fileLength += partEnd - offset;
+        }
+        else
+        {
+            RWebBodyPart part;
+            part.fileOffset = offset;
+            part.fileLength = partEnd - offset;
+            parts.push_back(std::move(part));
+        }
+        offset = partEnd;
+    }
+}
+
+// Returns the block with its data, or nullptr if it could not be read
+RWebBlockCache::BlockPtr
+RWebBlockCache::get(const RWebCachedFile& file, off_t blockIndex)
+{
+    // The etag changes with the file content
+    std::string key = file.etag + file.internalPath + "#" + std::to_string(blockIndex);
+    BlockPtr block;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto found = mEntries.find(key);
+        if (found != mEntries.end())
+        {
+            mLru.splice(mLru.begin(), mLru, found->second);
+            block = *found->second;
+            mHits.add();
+        }
+        else
+        {
+            block = std::make_shared<Block>();
+            block->key = key;
+            block->size = std::min(sBlockSize, file.size - blockIndex * sBlockSize);
+            if (block->size > mMaxBytes) { return nullptr; }
+
+            while (mBytes + block->size > mMaxBytes)
+            {
+                erase(std::prev(mLru.end()));
+            }
+            mLru.push_front(block);
+            mEntries[key] = mLru.begin();
+            mBytes += block->size;
+            mCachedBytes.add(block->size);
+            mMisses.add();
+        }
+    }
+
+    // Outside the lock, so other blocks are served during the read
+    std::call_once(block->readOnce, [&file, &block, blockIndex]()
+    {
+        block->data.resize(block->size);
+        if (!read_block(file.fd, blockIndex * sBlockSize, block->data))
+        {
+            RLOG(rlog::Critical, "RWebBlockCache: ERROR: read " << file.internalPath
+                                 << " block " << blockIndex << ", errno=" << errno);
+            block->data.clear();
+        }
+    });
+
+    if (block->data.empty())
+    {
+        remove(block);
+        return nullptr;
+    }
+    return block;
+}
+
+void
+RWebBlockCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    while (!mLru.empty())
+    {
+        erase(mLru.begin());
+    }
+}
+
+// Remove the block if it is still cached
+void
+RWebBlockCache::remove(const BlockPtr& block)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto found = mEntries.find(block->key);
+    if (found != mEntries.end() && *found->second == block)
+    {
+        erase(found->second);
+    }
+}
+
+// Requests that use the block keep it until they are done
+void
+RWebBlockCache::erase(LruList::iterator it)
+{
+    mBytes -= (*it)->size;
+    mCachedBytes.add(-(int64_t)(*it)->size);
+    mEntries.erase((*it)->key);
+    mLru.erase(it);
+}
@@ -0,0 +1,78 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebBodyProducer.h"
+
+// Encoders write in bursts. A larger pipe lets them run ahead while
+// the client is slow. The default is 64 kB
+static const int sPipeSize = 1024*1024;
+
+
+int spawn_command_pipe(const std::string& command)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+        RLOG(rlog::Critical, "ERROR: spawn_command_pipe: pipe failed, errno=" << errno);
+        return -1;
+    }
+    fcntl(fds[0], F_SETPIPE_SZ, sPipeSize);
+
+    // Fork twice, so the command is adopted by init and never left as a
+    // zombie. Only async signal safe calls in the children, since other
+    // threads may hold locks
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (fork() == 0)
+        {
+            int devNull = open("/dev/null", O_RDONLY);
+            if (devNull >= 0) { dup2(devNull, STDIN_FILENO); }
+            dup2(fds[1], STDOUT_FILENO);    // dup2 clears close-on-exec
+            signal(SIGPIPE, SIG_DFL);
+            execl("/bin/sh", "sh", "-c", command.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+
+    if (child < 0)
+    {
+        RLOG(rlog::Critical, "ERROR: spawn_command_pipe: fork failed, errno=" << errno);
+        close(fds[0]);
+        return -1;
+    }
+    waitpid(child, nullptr, 0);
+
+    RLOG(rlog::Verbose, "RWeb: started " << command);
+    return fds[0];
+}
+
+RWebBodyProducer command_body_producer(const std::string& command)
+{
+    return [command]()
+    {
+        return spawn_command_pipe(command);
+    };
+}
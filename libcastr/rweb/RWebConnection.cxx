@@ -0,0 +1,126 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rweb/RWebConnection.h"
+
+// Room before the data in bodyBuffer for the chunk size line, 16 hex digits and CRLF
+static const std::size_t sChunkHeaderSpace = 18;
+
+static const char sLastChunk[] = "0\r\n\r\n";
+
+void
+RWebConnection::closeBody()
+{
+    if (bodyFD >= 0 && !bodyFile)
+    {
+        close(bodyFD);
+    }
+    bodyFD = -1;
+    bodyFile.reset();
+    bodyOffset = 0;
+    bodyRemaining = 0;
+    bodyParts.clear();
+    bodySendMode = sm_Copy;
+    bodyUntilEnd = false;
+    bodyChunked = false;
+    bodyData = {};
+    bodyDataSent = 0;
+    bodyBuffer.clear();
+    bodyDataOwner.reset();
+}
+
+void
+RWebConnection::nextBodyPart()
+{
+    RWebBodyPart& part = bodyParts.front();
+
+    bodyData = {};
+    bodyDataSent = 0;
+    bodyDataOwner.reset();
+    if (part.fileLength > 0)
+    {
+        bodyOffset = part.fileOffset;
+        bodyRemaining = part.fileLength;
+    }
+    else if (part.sharedOwner)
+    {
+        bodyDataOwner = std::move(part.sharedOwner);
+        bodyData = part.sharedData;
+    }
+    else
+    {
+        bodyBuffer = std::move(part.data);
+        bodyData = bodyBuffer;
+    }
+    bodyParts.pop_front();
+}
+
+char*
+RWebConnection::prepareBodyRead(std::size_t& maxSize)
+{
+    maxSize = std::min<off_t>(maxSize, bodyRemaining);
+    bodyData = {};
+    bodyDataSent = 0;
+
+    if (!bodyChunked)
+    {
+        bodyBuffer.resize(maxSize);
+        return &bodyBuffer[0];
+    }
+
+    bodyBuffer.resize(sChunkHeaderSpace + maxSize + 2);
+    return &bodyBuffer[sChunkHeaderSpace];
+}
+
+void
+RWebConnection::bodyReadDone(std::size_t length)
+{
+    bodyDataSent = 0;
+
+    if (length == 0)
+    {
+        bodyRemaining = 0;
+        bodyData = bodyChunked ? std::string_view(sLastChunk, sizeof(sLastChunk) - 1) : std::string_view();
+        return;
+    }
+
+    bodyOffset += length;
+    if (!bodyUntilEnd)
+    {
+        bodyRemaining -= length;
+    }
+
+    if (!bodyChunked)
+    {
+        bodyData = std::string_view(bodyBuffer.data(), length);
+        return;
+    }
+
+    // Size line right before the data, and CRLF after it
+    char sizeLine[sChunkHeaderSpace + 1];
+    int sizeLineLength = snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", length);
+    std::size_t start = sChunkHeaderSpace - sizeLineLength;
+    memcpy(&bodyBuffer[start], sizeLine, sizeLineLength);
+    memcpy(&bodyBuffer[sChunkHeaderSpace + length], "\r\n", 2);
+    bodyData = std::string_view(bodyBuffer.data() + start, sizeLineLength + length + 2);
+}
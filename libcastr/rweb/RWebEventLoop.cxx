@@ -0,0 +1,855 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebEventLoop.h"
+#include "rweb/RWebUtils.h"
+#include "rweb/RWebWorkerPool.h"
+
+#define BUFSIZE 8096
+
+static const int sMaxEvents = 64;
+static const int sTimerIntervalMs = 500;
+
+// Connections accepted per loop wake up. Clients that are rejected
+// right away reconnect fast, and must not keep the loop accepting
+// forever while the accepted connections get no service.
+static const int sMaxAcceptsPerWakeup = 64;
+
+// Max bytes moved by one sendfile/splice call
+static const off_t sZeroCopyChunkSize = 1024*1024;
+
+// Max bytes read from a pipe into one chunk of a chunked body
+static const std::size_t sChunkSize = 64*1024;
+
+
+static bool set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) { return false; }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Send at most maxBytes of the body without copying it through user space.
+// Returns bytes sent, or -1 with errno set like send()
+static ssize_t send_body_zero_copy(RWebConnection& connection, std::size_t maxBytes)
+{
+    std::size_t count = std::min<off_t>(connection.bodyRemaining, maxBytes);
+
+    if (connection.bodySendMode == RWebConnection::sm_SendFile)
+    {
+        // sendfile updates bodyOffset
+        return sendfile(connection.fd, connection.bodyFD, &connection.bodyOffset, count);
+    }
+
+    ssize_t ret = splice(connection.bodyFD, nullptr, connection.fd, nullptr, count,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (ret > 0)
+    {
+        connection.bodyOffset += ret;
+    }
+    return ret;
+}
+
+
+RWebEventLoop::RWebEventLoop(int listenFD, RequestHandler requestHandler,
+                             RWebWorkerPool* workerPool,
+                             RWebClientLimiter* clientLimiter)
+  : mListenFD(listenFD),
+    mRequestHandler(requestHandler),
+    mWorkerPool(workerPool),
+    mClientLimiter(clientLimiter)
+{
+}
+
+RWebEventLoop::~RWebEventLoop()
+{
+    stop();
+}
+
+bool
+RWebEventLoop::start()
+{
+    if (!set_non_blocking(mListenFD))
+    {
+        RLOG(rlog::Critical, "ERROR: RWebEventLoop failed to set listen socket non-blocking, errno=" << errno);
+        return false;
+    }
+
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    mWakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEpollFD < 0 || mWakeFD < 0)
+    {
+        RLOG(rlog::Critical, "ERROR: RWebEventLoop failed to create epoll, errno=" << errno);
+        return false;
+    }
+
+    // Level triggered, so connections left after sMaxAcceptsPerWakeup
+    // are reported again by the next epoll_wait
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = mListenFD;
+    epoll_ctl(mEpollFD, EPOLL_CTL_ADD, mListenFD, &event);
+
+    event.events = EPOLLIN;
+    event.data.fd = mWakeFD;
+    epoll_ctl(mEpollFD, EPOLL_CTL_ADD, mWakeFD, &event);
+
+    mRunning = true;
+    mThread = std::thread(
+        [this](){
+            this->loop();
+        }
+    );
+    if (mCpu >= 0 && !pin_thread_to_cpu(mThread, mCpu))
+    {
+        RLOG(rlog::Important, "RWebEventLoop: failed to pin thread to cpu " << mCpu);
+    }
+
+    return true;
+}
+
+void
+RWebEventLoop::stop()
+{
+    if (mThread.joinable())
+    {
+        mRunning = false;
+        uint64_t wake = 1;
+        (void)write(mWakeFD, &wake, sizeof(wake));
+        mThread.join();
+    }
+
+    if (mEpollFD >= 0) { close(mEpollFD); }
+    if (mWakeFD >= 0) { close(mWakeFD); }
+    mEpollFD = -1;
+    mWakeFD = -1;
+}
+
+void
+RWebEventLoop::loop()
+{
+    struct epoll_event events[sMaxEvents];
+
+    RLOG(rlog::Verbose, "Server loop start");
+    while (mRunning)
+    {
+        int eventCount = epoll_wait(mEpollFD, events, sMaxEvents, waitTimeoutMs());
+        if (eventCount < 0)
+        {
+            if (errno == EINTR) { continue; }
+            RLOG(rlog::Critical, "ERROR: epoll_wait, errno=" << errno);
+            break;
+        }
+
+        for (int i=0; i<eventCount; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == mWakeFD)
+            {
+                uint64_t wakeCount;
+                (void)read(mWakeFD, &wakeCount, sizeof(wakeCount));
+                onHandled();
+                continue;
+            }
+            if (fd == mListenFD)
+            {
+                acceptConnections();
+                continue;
+            }
+
+            auto pipeBody = mPipeBodies.find(fd);
+            if (pipeBody != mPipeBodies.end())
+            {
+                // More data in body pipe. Same work as socket writable
+                fd = pipeBody->second;
+                events[i].events = EPOLLOUT;
+            }
+
+            auto it = mConnections.find(fd);
+            if (it == mConnections.end()) { continue; }
+            RWebConnection& connection = *it->second;
+
+            // A worker uses the connection. Socket is read and
+            // written again when the worker is done.
+            if (connection.state == RWebConnection::cs_Handling) { continue; }
+
+            if (events[i].events & EPOLLERR)
+            {
+                connection.state = RWebConnection::cs_Closed;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+            {
+                onReadable(connection);
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                scheduleSend(connection);
+            }
+            if (connection.state == RWebConnection::cs_Closed)
+            {
+                closeConnection(fd);
+            }
+        }
+
+        sendScheduledConnections();
+        resumePacedConnections();
+        closeExpiredConnections();
+    }
+
+    std::vector<int> openConnections;
+    for (auto& item : mConnections) { openConnections.push_back(item.first); }
+    for (int fd : openConnections) { closeConnection(fd); }
+
+    RLOG(rlog::Verbose, "Server loop finished");
+}
+
+void
+RWebEventLoop::acceptConnections()
+{
+    for (int i=0; i<sMaxAcceptsPerWakeup; ++i)
+    {
+        struct sockaddr_storage clientAddr = {};
+        socklen_t length = sizeof(clientAddr);
+
+        int socketfd = accept4(mListenFD, (struct sockaddr *)&clientAddr, &length,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socketfd < 0)
+        {
+            if (errno == EINTR) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                RLOG(rlog::Critical, "ERROR: socket accept, errno=" << errno);
+            }
+            return;
+        }
+
+        // Responses are written in few large sends, so Nagle only adds
+        // delay between pipelined responses on keep-alive connections.
+        int noDelay = 1;
+        setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        apply_connection_socket_options(socketfd, mSocketOptions);
+
+        auto connection = std::make_unique<RWebConnection>();
+        connection->fd = socketfd;
+        connection->clientAddress = socket_address_to_string(clientAddr);
+        connection->connectionId = mNextConnectionId++;
+        connection->requestBuffer.reserve(BUFSIZE);
+        connection->lastActivity = std::chrono::steady_clock::now();
+        startPacing(*connection);
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = socketfd;
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, socketfd, &event) < 0)
+        {
+            RLOG(rlog::Critical, "ERROR: epoll_ctl add, errno=" << errno);
+            close(socketfd);
+            continue;
+        }
+
+        RLOG(rlog::Verbose, "Accepted connection #" << connection->connectionId
+                            << " from " << connection->clientAddress);
+
+        // Added before anything is sent, so a failed send can close it
+        RWebConnection& added = *connection;
+        mConnections[socketfd] = std::move(connection);
+        mActiveConnections.add(1);
+
+        if (mClientLimiter && !mClientLimiter->acquire(added.clientAddress))
+        {
+            // Too many connections from this client. Answer 503 and close
+            added.clientAddress.clear();    // Nothing to release
+            added.requestStart = added.lastActivity;
+            added.responseHead = sServiceUnavailableMessage;
+            startResponse(added);
+            onWritable(added);
+            if (added.state == RWebConnection::cs_Closed)
+            {
+                closeConnection(socketfd);
+            }
+        }
+    }
+}
+
+void
+RWebEventLoop::onReadable(RWebConnection& connection)
+{
+    char buffer[BUFSIZE];
+
+    // Edge triggered, so we must read until the socket is empty.
+    // Not while a worker handles the request, since it uses requestBuffer.
+    while (connection.state != RWebConnection::cs_Closed
+           && connection.state != RWebConnection::cs_Handling)
+    {
+        ssize_t ret = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (ret > 0)
+        {
+            connection.lastActivity = std::chrono::steady_clock::now();
+            if (connection.state == RWebConnection::cs_Draining)
+            {
+                continue;   // Data after the last response is ignored
+            }
+            if (connection.requestBuffer.size() >= sMaxRequestBufferSize)
+            {
+                // Client sends more than we want to buffer. Close after this response
+                connection.keepAlive = false;
+                continue;
+            }
+            connection.requestBuffer.append(buffer, ret);
+            continue;
+        }
+        if (ret == 0)   // Client closed its end
+        {
+            connection.keepAlive = false;
+            if (connection.state != RWebConnection::cs_SendingResponse)
+            {
+                connection.state = RWebConnection::cs_Closed;
+            }
+            break;
+        }
+        if (errno == EINTR) { continue; }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            connection.state = RWebConnection::cs_Closed;
+        }
+        break;
+    }
+
+    if (startNextRequest(connection))
+    {
+        onWritable(connection);
+    }
+}
+
+bool
+RWebEventLoop::startNextRequest(RWebConnection& connection)
+{
+    if (connection.state != RWebConnection::cs_ReadingRequest) { return false; }
+
+    RWebRequestParser& parser = connection.requestParser;
+    RWebRequestParser::Result result = parser.parse(connection.requestBuffer, connection.request);
+    if (result == RWebRequestParser::pr_Incomplete) { return false; }
+
+    connection.requestStart = std::chrono::steady_clock::now();
+    connection.request.badRequest = (result == RWebRequestParser::pr_Error);
+    connection.keepAlive = false;
+
+    if (mWorkerPool && !connection.request.badRequest)
+    {
+        // The loop does not touch the connection until the worker is done.
+        connection.state = RWebConnection::cs_Handling;
+        RWebConnection* connectionPtr = &connection;
+        int fd = connection.fd;
+        bool queued = mWorkerPool->submit(
+            [this, connectionPtr, fd](){
+                mRequestHandler(*connectionPtr);
+                postHandled(fd);
+            }
+        );
+        if (queued) { return false; }
+
+        RLOG(rlog::Important, connection.connectionId << ": Worker queue full. Respond 503");
+        connection.state = RWebConnection::cs_ReadingRequest;
+        connection.responseHead = sServiceUnavailableMessage;
+    }
+    else
+    {
+        mRequestHandler(connection);
+    }
+
+    requestHandled(connection, connection.request.badRequest);
+
+    return true;
+}
+
+void
+RWebEventLoop::requestHandled(RWebConnection& connection, bool badRequest)
+{
+    RWebRequestParser& parser = connection.requestParser;
+
+    if (mAccessLog)
+    {
+        mAccessLog->beginRecord(connection);    // Before the request is removed from the buffer
+    }
+
+    if (badRequest)
+    {
+        // We do not know where the next request starts
+        connection.keepAlive = false;
+        connection.requestBuffer.clear();
+    }
+    else
+    {
+        connection.requestBuffer.erase(0, parser.consumedBytes());
+    }
+    parser.reset();
+    startResponse(connection);
+}
+
+// Called from worker thread
+void
+RWebEventLoop::postHandled(int fd)
+{
+    {
+        std::lock_guard<std::mutex> lock(mHandledMutex);
+        mHandled.push_back(fd);
+    }
+
+    uint64_t wake = 1;
+    (void)write(mWakeFD, &wake, sizeof(wake));
+}
+
+void
+RWebEventLoop::onHandled()
+{
+    std::vector<int> handled;
+    {
+        std::lock_guard<std::mutex> lock(mHandledMutex);
+        handled.swap(mHandled);
+    }
+
+    for (int fd : handled)
+    {
+        auto it = mConnections.find(fd);
+        if (it == mConnections.end()) { continue; }
+        RWebConnection& connection = *it->second;
+
+        requestHandled(connection, false);
+        onWritable(connection);
+
+        // Socket was not read while the worker had the connection
+        if (connection.state != RWebConnection::cs_Closed)
+        {
+            onReadable(connection);
+        }
+        if (connection.state == RWebConnection::cs_Closed)
+        {
+            closeConnection(fd);
+        }
+    }
+}
+
+void
+RWebEventLoop::startResponse(RWebConnection& connection)
+{
+    connection.state = RWebConnection::cs_SendingResponse;
+    connection.bytesSentZeroCopy = 0;
+    connection.bytesSentCopied = 0;
+    set_socket_cork(connection.fd, mSocketOptions, true);
+    applyResponsePriority(connection);
+
+    if (connection.bodyFD < 0) { return; }
+
+    // Only regular files are cached
+    if (connection.bodyFile)
+    {
+        connection.bodySendMode = RWebConnection::sm_SendFile;
+        return;
+    }
+
+    struct stat bodyStat = {};
+    fstat(connection.bodyFD, &bodyStat);
+
+    connection.bodySendMode = RWebConnection::sm_Copy;
+    if (S_ISREG(bodyStat.st_mode))
+    {
+        connection.bodySendMode = RWebConnection::sm_SendFile;
+    }
+    else if (S_ISFIFO(bodyStat.st_mode))
+    {
+        // Chunks are framed around the data in bodyBuffer, so they are copied
+        if (!connection.bodyChunked)
+        {
+            connection.bodySendMode = RWebConnection::sm_Splice;
+        }
+
+        // Pipe may be empty when the socket is writable.
+        // Wake up when more data arrives in the pipe.
+        struct epoll_event event = {};
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = connection.bodyFD;
+        set_non_blocking(connection.bodyFD);
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, connection.bodyFD, &event) == 0)
+        {
+            mPipeBodies[connection.bodyFD] = connection.fd;
+        }
+    }
+}
+
+void
+RWebEventLoop::closeBody(RWebConnection& connection)
+{
+    if (connection.bodyFD >= 0)
+    {
+        mPipeBodies.erase(connection.bodyFD);
+    }
+    connection.closeBody();
+}
+
+void
+RWebEventLoop::onWritable(RWebConnection& connection)
+{
+    if (connection.state != RWebConnection::cs_SendingResponse) { return; }
+
+    // Body bytes before other connections get their turn
+    std::size_t budget = send_budget(connection.priority);
+
+    while (true)
+    {
+        const char* data = nullptr;
+        std::size_t size = 0;
+        std::size_t* sent = nullptr;
+        int flags = MSG_NOSIGNAL;
+
+        if (connection.responseHeadSent < connection.responseHead.size())
+        {
+            data = connection.responseHead.data() + connection.responseHeadSent;
+            size = connection.responseHead.size() - connection.responseHeadSent;
+            sent = &connection.responseHeadSent;
+            if (connection.bodyRemaining > 0 || !connection.bodyParts.empty())
+            {
+                flags |= MSG_MORE;  // Let headers share packet with start of body
+            }
+        }
+        else if (connection.bodyDataSent < connection.bodyData.size())
+        {
+            if (budget == 0)
+            {
+                scheduleSend(connection);
+                return;
+            }
+            data = connection.bodyData.data() + connection.bodyDataSent;
+            size = pacing_allowance(connection, mTotalPacer,
+                                    std::min(connection.bodyData.size() - connection.bodyDataSent, budget));
+            sent = &connection.bodyDataSent;
+            if (size == 0)
+            {
+                waitForPacer(connection);
+                return;
+            }
+        }
+        else if (connection.bodyRemaining > 0
+                 && connection.bodySendMode != RWebConnection::sm_Copy)
+        {
+            if (budget == 0)
+            {
+                scheduleSend(connection);
+                return;
+            }
+            std::size_t allowance = pacing_allowance(connection, mTotalPacer,
+                                                     std::min<std::size_t>(sZeroCopyChunkSize, budget));
+            if (allowance == 0)
+            {
+                waitForPacer(connection);
+                return;
+            }
+
+            ssize_t ret = send_body_zero_copy(connection, allowance);
+            if (ret > 0)
+            {
+                connection.bodyRemaining -= ret;
+                connection.bytesSentZeroCopy += ret;
+                mBytesSent.add(ret);
+                pacing_consume(connection, mTotalPacer, ret);
+                budget -= ret;
+                connection.lastActivity = std::chrono::steady_clock::now();
+                continue;
+            }
+            if (ret == 0 && connection.bodyUntilEnd)
+            {
+                connection.bodyReadDone(0);
+                continue;
+            }
+            if (ret == 0)
+            {
+                RLOG(rlog::Critical, connection.connectionId << ": ERROR: body ended before Content-Length");
+                connection.state = RWebConnection::cs_Closed;
+                return;
+            }
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            {
+                // Not supported for this file or socket. Use the old copy loop instead
+                RLOG(rlog::Verbose, connection.connectionId << ": zero-copy send not supported, errno=" << errno);
+                connection.bodySendMode = RWebConnection::sm_Copy;
+                continue;
+            }
+
+            RLOG(rlog::Critical, connection.connectionId << ": ERROR: zero-copy send, errno=" << errno);
+            connection.state = RWebConnection::cs_Closed;
+            return;
+        }
+        else if (connection.bodyRemaining > 0)
+        {
+            // Read next block of the file
+            std::size_t blockSize = connection.bodyChunked ? sChunkSize : BUFSIZE;
+            char* block = connection.prepareBodyRead(blockSize);
+            ssize_t ret = pread(connection.bodyFD, block, blockSize, connection.bodyOffset);
+            if (ret < 0 && errno == ESPIPE)     // Pipes can not pread
+            {
+                ret = read(connection.bodyFD, block, blockSize);
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                connection.bodyBuffer.clear();
+                return;     // Continue when pipe has more data
+            }
+            if (ret < 0 || (ret == 0 && !connection.bodyUntilEnd))
+            {
+                RLOG(rlog::Critical, connection.connectionId << ": ERROR: file read, errno=" << errno);
+                connection.state = RWebConnection::cs_Closed;
+                return;
+            }
+            connection.bodyReadDone(ret);
+            continue;
+        }
+        else if (!connection.bodyParts.empty())
+        {
+            connection.nextBodyPart();
+            continue;
+        }
+        else
+        {
+            finishResponse(connection);
+
+            // Next request may already be buffered if the client pipelines requests
+            if (!startNextRequest(connection)) { return; }
+            continue;
+        }
+
+        ssize_t ret = send(connection.fd, data, size, flags);
+        if (ret < 0)
+        {
+            if (errno == EINTR) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                connection.state = RWebConnection::cs_Closed;   // Something went wrong, so we can stop trying to send
+            }
+            return;     // Continue on next EPOLLOUT
+        }
+        *sent += ret;
+        mBytesSent.add(ret);
+        if (sent == &connection.bodyDataSent)
+        {
+            connection.bytesSentCopied += ret;
+            pacing_consume(connection, mTotalPacer, ret);
+            budget -= ret;
+        }
+        connection.lastActivity = std::chrono::steady_clock::now();
+    }
+}
+
+void
+RWebEventLoop::finishResponse(RWebConnection& connection)
+{
+    RLOG(rlog::Verbose, connection.connectionId << ": SEND Finished. Zero-copy bytes: "
+         << connection.bytesSentZeroCopy << ", copied bytes: " << connection.bytesSentCopied);
+    if (mAccessLog)
+    {
+        mAccessLog->finishRecord(connection);
+    }
+    closeBody(connection);
+    set_socket_cork(connection.fd, mSocketOptions, false);
+    connection.lastActivity = std::chrono::steady_clock::now();
+    mRequestLatency.record(connection.lastActivity - connection.requestStart);
+
+    if (connection.keepAlive)
+    {
+        connection.responseHead.clear();
+        connection.responseHeadSent = 0;
+        connection.state = RWebConnection::cs_ReadingRequest;
+        return;
+    }
+
+    // Signal end of data, and let the client close the connection.
+    // Remaining client data is read and dropped until then.
+    shutdown(connection.fd, SHUT_WR);
+    connection.state = RWebConnection::cs_Draining;
+}
+
+void
+RWebEventLoop::closeConnection(int fd)
+{
+    auto it = mConnections.find(fd);
+    if (it == mConnections.end()) { return; }
+
+    RLOG(rlog::Verbose, "Close connection #" << it->second->connectionId);
+    closeBody(*it->second);
+    if (mClientLimiter && !it->second->clientAddress.empty())
+    {
+        mClientLimiter->release(it->second->clientAddress);
+    }
+    epoll_ctl(mEpollFD, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    mConnections.erase(it);
+    mActiveConnections.add(-1);
+}
+
+void
+RWebEventLoop::closeExpiredConnections()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - mLastTimeoutCheck < std::chrono::milliseconds(sTimerIntervalMs)) { return; }
+    mLastTimeoutCheck = now;
+
+    std::vector<int> expired;
+
+    for (auto& item : mConnections)
+    {
+        RWebConnection& connection = *item.second;
+        if (connection.state == RWebConnection::cs_Handling) { continue; }
+
+        std::chrono::seconds timeout = sIdleTimeout;
+        if (connection.state == RWebConnection::cs_Draining)
+        {
+            timeout = sDrainTimeout;
+        }
+        else if (connection.state == RWebConnection::cs_ReadingRequest
+                 && connection.requestBuffer.empty())
+        {
+            timeout = std::chrono::seconds(sKeepAliveTimeoutSeconds);
+        }
+        if (now - connection.lastActivity > timeout)
+        {
+            expired.push_back(item.first);
+        }
+    }
+
+    for (int fd : expired)
+    {
+        closeConnection(fd);
+    }
+}
+
+void
+RWebEventLoop::waitForPacer(RWebConnection& connection)
+{
+    if (connection.waitingForPacer) { return; }
+
+    connection.waitingForPacer = true;
+    mPacedConnections.push_back(connection.fd);
+}
+
+void
+RWebEventLoop::resumePacedConnections()
+{
+    if (mPacedConnections.empty()) { return; }
+
+    auto now = std::chrono::steady_clock::now();
+    std::vector<int> paced;
+    paced.swap(mPacedConnections);
+
+    for (int fd : paced)
+    {
+        auto it = mConnections.find(fd);
+        if (it == mConnections.end()) { continue; }
+        RWebConnection& connection = *it->second;
+        if (!connection.waitingForPacer) { continue; }  // Closed, and fd reused
+
+        if (connection.pacedUntil > now)
+        {
+            mPacedConnections.push_back(fd);
+            continue;
+        }
+
+        connection.waitingForPacer = false;
+        onWritable(connection);
+        if (connection.state == RWebConnection::cs_Closed)
+        {
+            closeConnection(fd);
+        }
+    }
+}
+
+// Time until the timer, the first paced connection or a scheduled send needs the loop
+int
+RWebEventLoop::waitTimeoutMs()
+{
+    for (auto& queue : mSendQueues)
+    {
+        if (!queue.empty()) { return 0; }   // Only check for new events
+    }
+    if (mPacedConnections.empty()) { return sTimerIntervalMs; }
+
+    auto first = std::chrono::steady_clock::time_point::max();
+    for (int fd : mPacedConnections)
+    {
+        auto it = mConnections.find(fd);
+        if (it != mConnections.end()) { first = std::min(first, it->second->pacedUntil); }
+    }
+
+    auto wait = first - std::chrono::steady_clock::now();
+    if (wait <= std::chrono::steady_clock::duration::zero()) { return 0; }
+
+    // Round up, so the connection is ready when the loop wakes up
+    auto waitMs = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+    return std::min<int64_t>(waitMs, sTimerIntervalMs);
+}
+
+void
+RWebEventLoop::scheduleSend(RWebConnection& connection)
+{
+    if (connection.sendScheduled || connection.state != RWebConnection::cs_SendingResponse) { return; }
+
+    connection.sendScheduled = true;
+    mSendQueues[connection.priority].push_back(connection.fd);
+}
+
+// Higher priorities first. Connections that use up their send budget
+// are scheduled again, and continue after the next check for events.
+void
+RWebEventLoop::sendScheduledConnections()
+{
+    for (auto& queue : mSendQueues)
+    {
+        std::vector<int> scheduled;
+        scheduled.swap(queue);
+
+        for (int fd : scheduled)
+        {
+            auto it = mConnections.find(fd);
+            if (it == mConnections.end()) { continue; }
+            RWebConnection& connection = *it->second;
+            if (!connection.sendScheduled) { continue; }    // Closed, and fd reused
+
+            connection.sendScheduled = false;
+            onWritable(connection);
+            if (connection.state == RWebConnection::cs_Closed)
+            {
+                closeConnection(fd);
+            }
+        }
+    }
+}
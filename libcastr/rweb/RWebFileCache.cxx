@@ -0,0 +1,236 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebFileCache.h"
+
+
+// Any of these means the file content or the file at the path may have changed.
+// A file replaced with rename() gets IN_ATTRIB since its link count changes.
+static const uint32_t sWatchMask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                                 | IN_DELETE_SELF | IN_MOVE_SELF;
+
+static const std::chrono::milliseconds sRevalidateInterval(1000);
+
+
+// The file at the path is the one that was opened, as it was then
+static bool matches_disk(const RWebCachedFile& file)
+{
+    struct stat fileStat = {};
+    return stat(file.internalPath.c_str(), &fileStat) == 0
+           && fileStat.st_ino == file.inode
+           && fileStat.st_size == file.size
+           && fileStat.st_mtime == file.mtime
+           && fileStat.st_mtim.tv_nsec == file.mtimeNanoseconds;
+}
+
+
+RWebCachedFile::~RWebCachedFile()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+
+RWebFileCache::RWebFileCache(std::size_t maxEntries)
+  : mMaxEntries(maxEntries)
+{
+    mInotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mInotifyFD < 0)
+    {
+        RLOG(rlog::Important, "RWebFileCache: inotify not available, errno=" << errno
+                              << ". Files are checked with stat()");
+    }
+}
+
+RWebFileCache::~RWebFileCache()
+{
+    clear();
+    if (mInotifyFD >= 0)
+    {
+        close(mInotifyFD);
+    }
+}
+
+RWebFileCache::FilePtr
+RWebFileCache::get(const std::string& publicPath)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    readChangeEvents();
+
+    auto found = mEntries.find(publicPath);
+    if (found == mEntries.end()) { return nullptr; }
+
+    LruList::iterator it = found->second;
+    if (!isUnchanged(**it))
+    {
+        RLOG(rlog::Verbose, "RWebFileCache: " << publicPath << " changed on disk");
+        erase(it);
+        return nullptr;
+    }
+
+    mLru.splice(mLru.begin(), mLru, it);
+    return *it;
+}
+
+void
+RWebFileCache::put(std::shared_ptr<RWebCachedFile> file)
+{
+    if (mMaxEntries == 0) { return; }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto found = mEntries.find(file->publicPath);
+    if (found != mEntries.end())
+    {
+        erase(found->second);
+    }
+    while (mLru.size() >= mMaxEntries)
+    {
+        erase(std::prev(mLru.end()));
+    }
+
+    file->lastValidated = std::chrono::steady_clock::now();
+    if (mInotifyFD >= 0)
+    {
+        file->watchDescriptor = inotify_add_watch(mInotifyFD, file->internalPath.c_str(), sWatchMask);
+    }
+
+    // Changes from here on are reported. A change after the file was
+    // opened, but before the watch was added, is only seen with stat()
+    if (!matches_disk(*file))
+    {
+        RLOG(rlog::Verbose, "RWebFileCache: " << file->publicPath << " changed while opened. Not cached");
+        if (file->watchDescriptor >= 0 && mWatches.count(file->watchDescriptor) == 0)
+        {
+            inotify_rm_watch(mInotifyFD, file->watchDescriptor);
+        }
+        file->watchDescriptor = -1;
+        return;
+    }
+
+    mLru.push_front(file);
+    mEntries[file->publicPath] = mLru.begin();
+    if (file->watchDescriptor >= 0)
+    {
+        mWatches.emplace(file->watchDescriptor, mLru.begin());
+    }
+}
+
+void
+RWebFileCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    while (!mLru.empty())
+    {
+        erase(mLru.begin());
+    }
+}
+
+// Drop all entries of files that inotify has reported as changed.
+// Done on every lookup, since live playlists are rewritten in place and
+// a stale entry would send the old Content-Length. The fd is non-blocking,
+// so an empty queue costs one read().
+void
+RWebFileCache::readChangeEvents()
+{
+    if (mInotifyFD < 0) { return; }
+
+    alignas(struct inotify_event) char buffer[4096];
+    while (true)
+    {
+        ssize_t length = read(mInotifyFD, buffer, sizeof(buffer));
+        if (length <= 0) { return; }
+
+        for (char* p = buffer; p < buffer + length; )
+        {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost. Nothing in the cache can be trusted
+                RLOG(rlog::Important, "RWebFileCache: inotify queue overflow");
+                while (!mLru.empty()) { erase(mLru.begin()); }
+                continue;
+            }
+
+            auto watch = mWatches.find(event->wd);
+            while (watch != mWatches.end())
+            {
+                RLOG(rlog::Verbose, "RWebFileCache: " << (*watch->second)->publicPath << " changed");
+                erase(watch->second);
+                watch = mWatches.find(event->wd);
+            }
+        }
+    }
+}
+
+// Files without inotify watch are compared with stat() once in a while
+bool
+RWebFileCache::isUnchanged(RWebCachedFile& file)
+{
+    if (file.watchDescriptor >= 0) { return true; }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - file.lastValidated < sRevalidateInterval) { return true; }
+
+    if (!matches_disk(file)) { return false; }
+
+    file.lastValidated = now;
+    return true;
+}
+
+void
+RWebFileCache::erase(LruList::iterator it)
+{
+    RWebCachedFile& file = **it;
+
+    mEntries.erase(file.publicPath);
+
+    if (file.watchDescriptor >= 0)
+    {
+        auto range = mWatches.equal_range(file.watchDescriptor);
+        for (auto watch = range.first; watch != range.second; ++watch)
+        {
+            if (watch->second == it)
+            {
+                mWatches.erase(watch);
+                break;
+            }
+        }
+
+        // inotify gives the same watch to all paths of one file
+        if (mWatches.count(file.watchDescriptor) == 0)
+        {
+            inotify_rm_watch(mInotifyFD, file.watchDescriptor);
+        }
+    }
+
+    // The file stays open until no connection uses it
+    mLru.erase(it);
+}
@@ -0,0 +1,907 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <limits>
+#include <string_view>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebMp4Index.h"
+#include "rweb/RWebUtils.h"
+
+// Media segments start at the first key frame after this time
+static const double sSegmentSeconds = 4.0;
+
+// Larger moov boxes are not parsed
+static const off_t sMaxIndexSize = 64*1024*1024;
+
+// Each sample takes memory in the index, and adds to the moov parse time
+static const uint32_t sMaxSampleCount = 4*1024*1024;
+
+// trun sample_flags. Samples after a key frame depend on other samples
+static const uint32_t sSyncSampleFlags = 0x02000000;
+static const uint32_t sNonSyncSampleFlags = 0x01010000;
+
+
+// A box in memory. data points to the size field
+struct Mp4Box
+{
+    std::string_view type;
+    const unsigned char* data = nullptr;
+    std::size_t size = 0;
+    std::size_t headerSize = 8;
+
+    const unsigned char* payload() const { return data + headerSize; }
+    std::size_t payloadSize() const { return size - headerSize; }
+};
+
+static uint32_t read_be32(const unsigned char* data)
+{
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+static uint64_t read_be64(const unsigned char* data)
+{
+    return (uint64_t(read_be32(data)) << 32) | read_be32(data + 4);
+}
+
+static void append_be32(std::string& out, uint32_t value)
+{
+    char bytes[4] = { char(value >> 24), char(value >> 16), char(value >> 8), char(value) };
+    out.append(bytes, sizeof(bytes));
+}
+
+static void append_be64(std::string& out, uint64_t value)
+{
+    append_be32(out, uint32_t(value >> 32));
+    append_be32(out, uint32_t(value));
+}
+
+static void write_be32(std::string& out, std::size_t position, uint32_t value)
+{
+    std::string bytes;
+    append_be32(bytes, value);
+    out.replace(position, bytes.size(), bytes);
+}
+
+// Append the header of a box. Returns its position for end_box()
+static std::size_t begin_box(std::string& out, const char* type)
+{
+    std::size_t start = out.size();
+    append_be32(out, 0);
+    out.append(type, 4);
+    return start;
+}
+
+static void end_box(std::string& out, std::size_t start)
+{
+    write_be32(out, start, uint32_t(out.size() - start));
+}
+
+// Boxes in size bytes of data. Returns false if a box does not fit
+static bool read_boxes(const unsigned char* data, std::size_t size, std::vector<Mp4Box>& boxes)
+{
+    std::size_t position = 0;
+    while (position + 8 <= size)
+    {
+        Mp4Box box;
+        box.data = data + position;
+        box.type = std::string_view((const char*)data + position + 4, 4);
+        uint64_t boxSize = read_be32(box.data);
+        if (boxSize == 1)
+        {
+            if (position + 16 > size) { return false; }
+            boxSize = read_be64(box.data + 8);
+            box.headerSize = 16;
+        }
+        else if (boxSize == 0)
+        {
+            boxSize = size - position;  // Box ends at end of parent
+        }
+        if (boxSize < box.headerSize || boxSize > size - position) { return false; }
+
+        box.size = boxSize;
+        boxes.push_back(box);
+        position += boxSize;
+    }
+    return true;
+}
+
+static bool read_children(const Mp4Box& box, std::vector<Mp4Box>& children)
+{
+    return read_boxes(box.payload(), box.payloadSize(), children);
+}
+
+static const Mp4Box* find_box(const std::vector<Mp4Box>& boxes, std::string_view type)
+{
+    for (const Mp4Box& box : boxes)
+    {
+        if (box.type == type) { return &box; }
+    }
+    return nullptr;
+}
+
+// Full box with version, flags and at least minSize bytes of content
+static const Mp4Box* find_full_box(const std::vector<Mp4Box>& boxes, std::string_view type, std::size_t minSize)
+{
+    const Mp4Box* box = find_box(boxes, type);
+    return (box && box->payloadSize() >= 4 + minSize) ? box : nullptr;
+}
+
+// Copy of a trak box for the init segment. The sample tables are empty,
+// the samples are described by the moof of each media segment
+static void append_empty_trak(const Mp4Box& box, std::string& out)
+{
+    if (box.type == "stts" || box.type == "ctts" || box.type == "stss" || box.type == "stsc"
+        || box.type == "stsz" || box.type == "stz2" || box.type == "stco" || box.type == "co64"
+        || box.type == "sdtp" || box.type == "stps")
+    {
+        return;     // Replaced by empty tables after stsd
+    }
+    if (box.type != "trak" && box.type != "mdia" && box.type != "minf" && box.type != "stbl")
+    {
+        out.append((const char*)box.data, box.size);
+        return;
+    }
+
+    std::vector<Mp4Box> children;
+    read_children(box, children);
+
+    std::size_t start = begin_box(out, std::string(box.type).c_str());
+    for (const Mp4Box& child : children)
+    {
+        append_empty_trak(child, out);
+    }
+    if (box.type == "stbl")
+    {
+        for (const char* table : {"stts", "stsc", "stco"})
+        {
+            std::size_t tableStart = begin_box(out, table);
+            append_be32(out, 0);    // Version and flags
+            append_be32(out, 0);    // Entry count
+            end_box(out, tableStart);
+        }
+        std::size_t tableStart = begin_box(out, "stsz");
+        append_be32(out, 0);
+        append_be32(out, 0);    // Sample size
+        append_be32(out, 0);    // Sample count
+        end_box(out, tableStart);
+    }
+    end_box(out, start);
+}
+
+
+// Expand the sample tables of a stbl box. Returns false if they are
+// missing or inconsistent, or if samples are outside the file
+static bool read_sample_tables(const std::vector<Mp4Box>& stbl, off_t fileSize,
+                               std::vector<RWebMp4Index::Sample>& samples)
+{
+    const Mp4Box* stsz = find_full_box(stbl, "stsz", 8);
+    const Mp4Box* stts = find_full_box(stbl, "stts", 4);
+    const Mp4Box* stsc = find_full_box(stbl, "stsc", 4);
+    const Mp4Box* stco = find_full_box(stbl, "stco", 4);
+    const Mp4Box* co64 = find_full_box(stbl, "co64", 4);
+    if (!stsz || !stts || !stsc || (!stco && !co64)) { return false; }
+
+    // Entry count follows version and flags
+    auto entries = [](const Mp4Box& box, std::size_t entrySize, uint32_t& count)
+    {
+        count = read_be32(box.payload() + 4);
+        return (box.payloadSize() - 8) / entrySize >= count ? box.payload() + 8 : nullptr;
+    };
+
+    uint32_t sampleSize = read_be32(stsz->payload() + 4);
+    uint32_t sampleCount = read_be32(stsz->payload() + 8);
+    if (sampleCount == 0 || sampleCount > sMaxSampleCount) { return false; }
+    if (sampleSize == 0 && (stsz->payloadSize() - 12) / 4 < sampleCount) { return false; }
+
+    samples.resize(sampleCount);
+    for (uint32_t i=0; i<sampleCount; ++i)
+    {
+        samples[i].size = sampleSize ? sampleSize : read_be32(stsz->payload() + 12 + 4*i);
+    }
+
+    uint32_t count = 0;
+    const unsigned char* entry = entries(*stts, 8, count);
+    if (!entry) { return false; }
+    std::size_t sample = 0;
+    for (uint32_t i=0; i<count; ++i, entry += 8)
+    {
+        for (uint32_t j=0; j<read_be32(entry) && sample < sampleCount; ++j)
+        {
+            samples[sample++].duration = read_be32(entry + 4);
+        }
+    }
+    if (sample < sampleCount) { return false; }
+
+    // Version 0 offsets are unsigned, but never that large
+    const Mp4Box* ctts = find_full_box(stbl, "ctts", 4);
+    if (ctts && (entry = entries(*ctts, 8, count)))
+    {
+        sample = 0;
+        for (uint32_t i=0; i<count; ++i, entry += 8)
+        {
+            for (uint32_t j=0; j<read_be32(entry) && sample < sampleCount; ++j)
+            {
+                samples[sample++].compositionOffset = int32_t(read_be32(entry + 4));
+            }
+        }
+    }
+
+    // Without stss every sample is a key frame
+    const Mp4Box* stss = find_full_box(stbl, "stss", 4);
+    if (stss && (entry = entries(*stss, 4, count)))
+    {
+        for (RWebMp4Index::Sample& s : samples) { s.sync = false; }
+        for (uint32_t i=0; i<count; ++i, entry += 4)
+        {
+            uint32_t number = read_be32(entry);
+            if (number >= 1 && number <= sampleCount) { samples[number - 1].sync = true; }
+        }
+    }
+
+    std::vector<uint64_t> chunkOffsets;
+    if (stco && (entry = entries(*stco, 4, count)))
+    {
+        for (uint32_t i=0; i<count; ++i, entry += 4) { chunkOffsets.push_back(read_be32(entry)); }
+    }
+    else if (co64 && (entry = entries(*co64, 8, count)))
+    {
+        for (uint32_t i=0; i<count; ++i, entry += 8) { chunkOffsets.push_back(read_be64(entry)); }
+    }
+
+    // Runs of chunks with the same number of samples. Samples follow
+    // each other in their chunk
+    entry = entries(*stsc, 12, count);
+    if (!entry) { return false; }
+    sample = 0;
+    for (uint32_t i=0; i<count && sample < sampleCount; ++i, entry += 12)
+    {
+        uint64_t firstChunk = read_be32(entry);
+        uint32_t samplesPerChunk = read_be32(entry + 4);
+        uint64_t endChunk = (i + 1 < count) ? read_be32(entry + 12) : chunkOffsets.size() + 1;
+        if (firstChunk == 0 || endChunk > chunkOffsets.size() + 1) { return false; }
+
+        for (uint64_t chunk = firstChunk; chunk < endChunk && sample < sampleCount; ++chunk)
+        {
+            uint64_t offset = chunkOffsets[chunk - 1];
+            for (uint32_t j=0; j<samplesPerChunk && sample < sampleCount; ++j)
+            {
+                samples[sample].offset = offset;
+                offset += samples[sample].size;
+                ++sample;
+            }
+        }
+    }
+    if (sample < sampleCount) { return false; }
+
+    for (const RWebMp4Index::Sample& s : samples)
+    {
+        if (s.offset + s.size > uint64_t(fileSize)) { return false; }
+    }
+    return true;
+}
+
+// Track id, timescale, handler type and samples of a trak box
+static bool read_track(const Mp4Box& trak, off_t fileSize, RWebMp4Index::Track& track)
+{
+    std::vector<Mp4Box> trakBoxes;
+    std::vector<Mp4Box> mdiaBoxes;
+    std::vector<Mp4Box> minfBoxes;
+    std::vector<Mp4Box> stblBoxes;
+    if (!read_children(trak, trakBoxes)) { return false; }
+
+    const Mp4Box* tkhd = find_full_box(trakBoxes, "tkhd", 20);
+    const Mp4Box* mdia = find_box(trakBoxes, "mdia");
+    if (!tkhd || !mdia || !read_children(*mdia, mdiaBoxes)) { return false; }
+
+    const Mp4Box* mdhd = find_full_box(mdiaBoxes, "mdhd", 20);
+    const Mp4Box* hdlr = find_full_box(mdiaBoxes, "hdlr", 8);
+    const Mp4Box* minf = find_box(mdiaBoxes, "minf");
+    if (!mdhd || !hdlr || !minf || !read_children(*minf, minfBoxes)) { return false; }
+
+    const Mp4Box* stbl = find_box(minfBoxes, "stbl");
+    if (!stbl || !read_children(*stbl, stblBoxes)) { return false; }
+
+    // Version 1 has 64 bit times before these fields
+    track.id = read_be32(tkhd->payload() + (tkhd->payload()[0] == 1 ? 20 : 12));
+    track.timescale = read_be32(mdhd->payload() + (mdhd->payload()[0] == 1 ? 20 : 12));
+    track.handler = std::string((const char*)hdlr->payload() + 8, 4);
+
+    return track.timescale > 0 && read_sample_tables(stblBoxes, fileSize, track.samples);
+}
+
+// Add shift to the chunk offsets in stco and co64 boxes that point into
+// [from, to) of the file. Returns false if an stco offset gets too large
+static bool shift_chunk_offsets(std::string& moov, const Mp4Box& box, uint64_t from, uint64_t to, uint64_t shift)
+{
+    if (box.type == "stco" || box.type == "co64")
+    {
+        std::size_t entrySize = (box.type == "co64") ? 8 : 4;
+        if (box.payloadSize() < 8) { return false; }
+        uint32_t count = read_be32(box.payload() + 4);
+        if ((box.payloadSize() - 8) / entrySize < count) { return false; }
+
+        std::size_t position = box.payload() + 8 - (const unsigned char*)moov.data();
+        for (uint32_t i=0; i<count; ++i, position += entrySize)
+        {
+            const unsigned char* entry = (const unsigned char*)moov.data() + position;
+            uint64_t offset = (entrySize == 8) ? read_be64(entry) : read_be32(entry);
+            if (offset < from || offset >= to) { continue; }
+
+            offset += shift;
+            if (entrySize == 8)
+            {
+                write_be32(moov, position, uint32_t(offset >> 32));
+                write_be32(moov, position + 4, uint32_t(offset));
+            }
+            else if (offset > UINT32_MAX)
+            {
+                return false;
+            }
+            else
+            {
+                write_be32(moov, position, uint32_t(offset));
+            }
+        }
+        return true;
+    }
+    if (box.type != "moov" && box.type != "trak" && box.type != "mdia" && box.type != "minf" && box.type != "stbl")
+    {
+        return true;
+    }
+
+    std::vector<Mp4Box> children;
+    if (!read_children(box, children)) { return false; }
+    for (const Mp4Box& child : children)
+    {
+        if (!shift_chunk_offsets(moov, child, from, to, shift)) { return false; }
+    }
+    return true;
+}
+
+static bool read_at(int fd, off_t offset, std::string& data)
+{
+    std::size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t ret = pread(fd, &data[done], data.size() - done, offset + done);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret <= 0) { return false; }
+        done += ret;
+    }
+    return true;
+}
+
+// Find the first top level box of type in an MP4 file.
+// Returns false for other files
+static bool find_top_level_box(int fd, off_t fileSize, const char* type, off_t& boxOffset, off_t& boxLength)
+{
+    off_t position = 0;
+    for (int i=0; i<64 && position + 8 <= fileSize; ++i)
+    {
+        unsigned char header[16];
+        ssize_t ret = pread(fd, header, sizeof(header), position);
+        if (ret < 8) { return false; }
+
+        // MP4 files start with ftyp. Do not seek around in other files
+        if (i == 0 && memcmp(header + 4, "ftyp", 4) != 0) { return false; }
+
+        uint64_t boxSize = read_be32(header);
+        if (boxSize == 1 && ret == 16)
+        {
+            boxSize = read_be64(header + 8);
+        }
+        else if (boxSize == 0)
+        {
+            boxSize = fileSize - position;  // Box ends at end of file
+        }
+        if (boxSize < 8) { return false; }
+
+        if (memcmp(header + 4, type, 4) == 0)
+        {
+            boxOffset = position;
+            boxLength = std::min<off_t>(boxSize, fileSize - position);
+            return true;
+        }
+        position += boxSize;
+    }
+    return false;
+}
+
+// Percent encode all but unreserved characters, for names in the playlist
+static std::string url_encode_name(const std::string& name)
+{
+    static const char* hex = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : name)
+    {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+        {
+            encoded += c;
+        }
+        else
+        {
+            encoded += '%';
+            encoded += hex[c >> 4];
+            encoded += hex[c & 15];
+        }
+    }
+    return encoded;
+}
+
+
+bool find_mp4_index(int fd, off_t fileSize, off_t& indexOffset, off_t& indexLength)
+{
+    return find_top_level_box(fd, fileSize, "moov", indexOffset, indexLength);
+}
+
+bool parse_mp4_hls_path(const std::string& path, std::string& mp4Path,
+                        Mp4HlsResource& resource, std::size_t& segmentIndex)
+{
+    std::string lowerPath = ascii_to_lower(path);
+    if (ends_with(lowerPath, ".mp4.m3u8"))
+    {
+        mp4Path = path.substr(0, path.size() - 5);
+        resource = mh_Playlist;
+        return true;
+    }
+    if (ends_with(lowerPath, ".mp4.init.mp4"))
+    {
+        mp4Path = path.substr(0, path.size() - 9);
+        resource = mh_InitSegment;
+        return true;
+    }
+    if (!ends_with(lowerPath, ".m4s")) { return false; }
+
+    // "<file>.mp4.<index>.m4s"
+    std::size_t numberEnd = path.size() - 4;
+    std::size_t numberStart = path.rfind('.', numberEnd - 1);
+    if (numberStart == std::string::npos || numberEnd - numberStart < 2 || numberEnd - numberStart > 10)
+    {
+        return false;
+    }
+    for (std::size_t i = numberStart + 1; i < numberEnd; ++i)
+    {
+        if (!isdigit((unsigned char)path[i])) { return false; }
+    }
+    if (!ends_with(lowerPath.substr(0, numberStart), ".mp4")) { return false; }
+
+    mp4Path = path.substr(0, numberStart);
+    segmentIndex = strtoul(path.c_str() + numberStart + 1, nullptr, 10);
+    resource = mh_MediaSegment;
+    return true;
+}
+
+
+std::shared_ptr<const RWebMp4Index>
+RWebMp4Index::create(int fd, off_t fileSize)
+{
+    off_t indexOffset = 0;
+    off_t indexLength = 0;
+    if (!find_mp4_index(fd, fileSize, indexOffset, indexLength) || indexLength > sMaxIndexSize)
+    {
+        return nullptr;
+    }
+
+    std::string moov(indexLength, '\0');
+    if (!read_at(fd, indexOffset, moov)) { return nullptr; }
+
+    auto index = std::make_shared<RWebMp4Index>();
+    if (!index->parse(moov, fileSize)) { return nullptr; }
+
+    index->createSegments();
+    return index;
+}
+
+bool
+RWebMp4Index::parse(const std::string& moov, off_t fileSize)
+{
+    std::vector<Mp4Box> topBoxes;
+    std::vector<Mp4Box> moovBoxes;
+    if (!read_boxes((const unsigned char*)moov.data(), moov.size(), topBoxes) || topBoxes.empty()
+        || !read_children(topBoxes[0], moovBoxes))
+    {
+        return false;
+    }
+
+    // Fragmented files have their samples in moof boxes, and can be served as they are
+    const Mp4Box* mvhd = find_box(moovBoxes, "mvhd");
+    if (!mvhd || find_box(moovBoxes, "mvex")) { return false; }
+
+    // The first video and audio tracks, which players select by default
+    const Mp4Box* videoTrak = nullptr;
+    const Mp4Box* audioTrak = nullptr;
+    for (const Mp4Box& box : moovBoxes)
+    {
+        if (box.type != "trak") { continue; }
+
+        Track track;
+        bool ok = read_track(box, fileSize, track);
+        if (track.handler == "vide" && !videoTrak)
+        {
+            if (!ok) { return false; }
+            mTracks.insert(mTracks.begin(), std::move(track));
+            videoTrak = &box;
+        }
+        else if (track.handler == "soun" && !audioTrak)
+        {
+            if (!ok) { return false; }
+            mTracks.push_back(std::move(track));
+            audioTrak = &box;
+        }
+    }
+    if (mTracks.empty()) { return false; }
+
+    std::size_t ftyp = begin_box(mInitSegment, "ftyp");
+    mInitSegment.append("iso6", 4);     // Major brand
+    append_be32(mInitSegment, 0);
+    mInitSegment.append("iso6isommp41", 12);
+    end_box(mInitSegment, ftyp);
+
+    std::size_t moovStart = begin_box(mInitSegment, "moov");
+    mInitSegment.append((const char*)mvhd->data, mvhd->size);
+    for (const Mp4Box* trak : {videoTrak, audioTrak})
+    {
+        if (trak) { append_empty_trak(*trak, mInitSegment); }
+    }
+
+    // Tracks have their samples in fragments
+    std::size_t mvex = begin_box(mInitSegment, "mvex");
+    for (const Track& track : mTracks)
+    {
+        std::size_t trex = begin_box(mInitSegment, "trex");
+        append_be32(mInitSegment, 0);   // Version and flags
+        append_be32(mInitSegment, track.id);
+        append_be32(mInitSegment, 1);   // Sample description index
+        append_be32(mInitSegment, 0);   // Sample duration, size and flags are in each trun
+        append_be32(mInitSegment, 0);
+        append_be32(mInitSegment, 0);
+        end_box(mInitSegment, trex);
+    }
+    end_box(mInitSegment, mvex);
+    end_box(mInitSegment, moovStart);
+
+    return true;
+}
+
+// Segments start at key frames of the first track, which is video if the file
+// has video. Samples of the other track go to the segment where they start
+void
+RWebMp4Index::createSegments()
+{
+    const Track& first = mTracks[0];
+    uint64_t segmentLength = uint64_t(sSegmentSeconds * first.timescale);
+
+    std::vector<uint64_t> startTimes;   // In timescale of the first track
+    uint64_t time = 0;
+    for (const Sample& sample : first.samples)
+    {
+        if (startTimes.empty() || (sample.sync && time - startTimes.back() >= segmentLength))
+        {
+            startTimes.push_back(time);
+        }
+        time += sample.duration;
+    }
+
+    mSegments.resize(startTimes.size());
+    for (std::size_t i=0; i<mSegments.size(); ++i)
+    {
+        uint64_t end = (i + 1 < startTimes.size()) ? startTimes[i + 1] : time;
+        mSegments[i].duration = double(end - startTimes[i]) / first.timescale;
+    }
+
+    for (const Track& track : mTracks)
+    {
+        std::size_t sample = 0;
+        uint64_t decodeTime = 0;
+        for (std::size_t i=0; i<mSegments.size(); ++i)
+        {
+            TrackRange range;
+            range.first = sample;
+            range.decodeTime = decodeTime;
+
+            bool last = (i + 1 == mSegments.size());
+            double segmentEnd = last ? 0 : double(startTimes[i + 1]) / first.timescale;
+            while (sample < track.samples.size()
+                   && (last || double(decodeTime) / track.timescale < segmentEnd))
+            {
+                decodeTime += track.samples[sample].duration;
+                ++sample;
+            }
+            range.end = sample;
+            mSegments[i].tracks.push_back(range);
+        }
+    }
+}
+
+std::string
+RWebMp4Index::playlist(const std::string& mp4Name) const
+{
+    std::string name = url_encode_name(mp4Name);
+
+    // Segment durations rounded to whole seconds must not be longer
+    double longest = 0;
+    for (const Segment& segment : mSegments)
+    {
+        longest = std::max(longest, segment.duration);
+    }
+
+    std::string text = "#EXTM3U\n"
+                       "#EXT-X-VERSION:7\n"
+                       "#EXT-X-TARGETDURATION:" + std::to_string(std::max(1L, std::lround(longest))) + "\n"
+                       "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                       "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                       "#EXT-X-MAP:URI=\"" + name + ".init.mp4\"\n";
+    for (std::size_t i=0; i<mSegments.size(); ++i)
+    {
+        char duration[32];
+        snprintf(duration, sizeof(duration), "%.6f", mSegments[i].duration);
+        text += std::string("#EXTINF:") + duration + ",\n"
+                + name + "." + std::to_string(i) + ".m4s\n";
+    }
+    text += "#EXT-X-ENDLIST\n";
+
+    return text;
+}
+
+off_t
+RWebMp4Index::appendMediaSegment(std::size_t segmentIndex, std::deque<RWebBodyPart>& parts) const
+{
+    const Segment& segment = mSegments[segmentIndex];
+
+    // The samples of each track follow each other in mdat
+    uint64_t dataSize = 0;
+    std::vector<uint64_t> trackDataStart;
+    for (std::size_t t=0; t<mTracks.size(); ++t)
+    {
+        trackDataStart.push_back(dataSize);
+        for (std::size_t i = segment.tracks[t].first; i < segment.tracks[t].end; ++i)
+        {
+            dataSize += mTracks[t].samples[i].size;
+        }
+    }
+
+    RWebBodyPart header;
+    std::string& moof = header.data;
+    std::size_t moofStart = begin_box(moof, "moof");
+
+    std::size_t mfhd = begin_box(moof, "mfhd");
+    append_be32(moof, 0);
+    append_be32(moof, uint32_t(segmentIndex + 1));  // Sequence number
+    end_box(moof, mfhd);
+
+    std::vector<std::pair<std::size_t, uint64_t>> dataOffsets;  // Position in moof, start in mdat
+    for (std::size_t t=0; t<mTracks.size(); ++t)
+    {
+        const Track& track = mTracks[t];
+        const TrackRange& range = segment.tracks[t];
+        if (range.first == range.end) { continue; }
+
+        std::size_t traf = begin_box(moof, "traf");
+
+        std::size_t tfhd = begin_box(moof, "tfhd");
+        append_be32(moof, 0x020000);    // default-base-is-moof
+        append_be32(moof, track.id);
+        end_box(moof, tfhd);
+
+        std::size_t tfdt = begin_box(moof, "tfdt");
+        append_be32(moof, 0x01000000);  // Version 1, 64 bit time
+        append_be64(moof, range.decodeTime);
+        end_box(moof, tfdt);
+
+        // Version 1 for signed composition offsets. Flags: data offset,
+        // and duration, size, flags and composition offset of each sample
+        std::size_t trun = begin_box(moof, "trun");
+        append_be32(moof, 0x01000F01);
+        append_be32(moof, uint32_t(range.end - range.first));
+        dataOffsets.emplace_back(moof.size(), trackDataStart[t]);
+        append_be32(moof, 0);
+        for (std::size_t i = range.first; i < range.end; ++i)
+        {
+            const Sample& sample = track.samples[i];
+            append_be32(moof, sample.duration);
+            append_be32(moof, sample.size);
+            append_be32(moof, sample.sync ? sSyncSampleFlags : sNonSyncSampleFlags);
+            append_be32(moof, uint32_t(sample.compositionOffset));
+        }
+        end_box(moof, trun);
+
+        end_box(moof, traf);
+    }
+    end_box(moof, moofStart);
+
+    std::size_t mdatHeaderSize = (dataSize + 8 > UINT32_MAX) ? 16 : 8;
+    for (const auto& dataOffset : dataOffsets)
+    {
+        write_be32(moof, dataOffset.first, uint32_t(moof.size() + mdatHeaderSize + dataOffset.second));
+    }
+    if (mdatHeaderSize == 16)
+    {
+        append_be32(moof, 1);
+        moof.append("mdat", 4);
+        append_be64(moof, dataSize + 16);
+    }
+    else
+    {
+        append_be32(moof, uint32_t(dataSize + 8));
+        moof.append("mdat", 4);
+    }
+
+    off_t length = moof.size() + dataSize;
+    parts.push_back(std::move(header));
+
+    // Samples that follow each other in the file are sent as one range
+    for (std::size_t t=0; t<mTracks.size(); ++t)
+    {
+        for (std::size_t i = segment.tracks[t].first; i < segment.tracks[t].end; ++i)
+        {
+            const Sample& sample = mTracks[t].samples[i];
+            RWebBodyPart& last = parts.back();
+            if (last.fileLength > 0 && uint64_t(last.fileOffset + last.fileLength) == sample.offset)
+            {
+                last.fileLength += sample.size;
+                continue;
+            }
+            RWebBodyPart range;
+            range.fileOffset = sample.offset;
+            range.fileLength = sample.size;
+            parts.push_back(std::move(range));
+        }
+    }
+
+    return length;
+}
+
+
+std::shared_ptr<const RWebMp4Faststart>
+RWebMp4Faststart::create(int fd, off_t fileSize)
+{
+    off_t indexOffset = 0;
+    off_t indexLength = 0;
+    off_t mediaOffset = 0;
+    off_t mediaLength = 0;
+    if (!find_mp4_index(fd, fileSize, indexOffset, indexLength) || indexLength > sMaxIndexSize
+        || !find_top_level_box(fd, fileSize, "mdat", mediaOffset, mediaLength) || mediaOffset > indexOffset)
+    {
+        return nullptr;
+    }
+
+    auto layout = std::make_shared<RWebMp4Faststart>();
+    layout->mMediaOffset = mediaOffset;
+    layout->mIndexOffset = indexOffset;
+    layout->mIndex.resize(indexLength);
+    std::string& moov = layout->mIndex;
+
+    // A truncated moov box does not fit in the data read
+    std::vector<Mp4Box> boxes;
+    if (!read_at(fd, indexOffset, moov)
+        || !read_boxes((const unsigned char*)moov.data(), moov.size(), boxes) || boxes.size() != 1)
+    {
+        return nullptr;
+    }
+
+    // Everything from the first mdat to moov is sent after moov
+    if (!shift_chunk_offsets(moov, boxes[0], mediaOffset, indexOffset, indexLength))
+    {
+        RLOG(rlog::Verbose, "RWebMp4Faststart: chunk offsets do not fit in stco");
+        return nullptr;
+    }
+    return layout;
+}
+
+void
+RWebMp4Faststart::appendRange(off_t offset, off_t length, std::deque<RWebBodyPart>& parts) const
+{
+    off_t indexLength = mIndex.size();
+
+    // Parts of the layout, and where they are in the file. -1 is the moov in memory
+    struct Piece
+    {
+        off_t start;
+        off_t end;
+        off_t fileOffset;
+    };
+    const Piece pieces[] =
+    {
+        { 0, mMediaOffset, 0 },
+        { mMediaOffset, mMediaOffset + indexLength, -1 },
+        { mMediaOffset + indexLength, mIndexOffset + indexLength, mMediaOffset },
+        { mIndexOffset + indexLength, std::numeric_limits<off_t>::max(), mIndexOffset + indexLength }
+    };
+
+    off_t end = offset + length;
+    for (const Piece& piece : pieces)
+    {
+        off_t partStart = std::max(offset, piece.start);
+        off_t partEnd = std::min(end, piece.end);
+        if (partStart >= partEnd) { continue; }
+
+        RWebBodyPart part;
+        if (piece.fileOffset < 0)
+        {
+            part.sharedData = std::string_view(mIndex).substr(partStart - piece.start, partEnd - partStart);
+            part.sharedOwner = shared_from_this();
+        }
+        else
+        {
+            part.fileOffset = piece.fileOffset + partStart - piece.start;
+            part.fileLength = partEnd - partStart;
+        }
+        parts.push_back(std::move(part));
+    }
+}
+
+
+RWebMp4IndexCache::RWebMp4IndexCache(std::size_t maxEntries)
+  : mMaxEntries(maxEntries)
+{
+}
+
+RWebMp4IndexCache::IndexPtr
+RWebMp4IndexCache::get(const RWebCachedFile& file)
+{
+    // The etag changes with the file content
+    std::string key = file.etag + file.internalPath;
+    EntryPtr entry;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto found = mEntries.find(key);
+        if (found != mEntries.end())
+        {
+            mLru.splice(mLru.begin(), mLru, found->second);
+            entry = *found->second;
+        }
+        else
+        {
+            if (mLru.size() >= mMaxEntries)
+            {
+                mEntries.erase(mLru.back()->key);
+                mLru.pop_back();
+            }
+            entry = std::make_shared<Entry>();
+            entry->key = key;
+            mLru.push_front(entry);
+            mEntries[key] = mLru.begin();
+        }
+    }
+
+    // Outside the lock, so other files are served during the parse
+    std::call_once(entry->parseOnce, [&file, &entry]()
+    {
+        entry->index = RWebMp4Index::create(file.fd, file.size);
+        if (entry->index)
+        {
+            RLOG(rlog::Verbose, "RWebMp4Index: " << file.internalPath << ", "
+                                << entry->index->segmentCount() << " segments");
+        }
+        else
+        {
+            RLOG(rlog::Important, "RWebMp4Index: can not make HLS of " << file.internalPath);
+        }
+    });
+
+    return entry->index;
+}
@@ -0,0 +1,114 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <algorithm>
+#include <climits>
+#include <sys/socket.h>
+
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebPacing.h"
+
+// Max tokens is the rate for this time, so a paced connection still
+// sends in large parts and wakes up the loop a few times per second
+static const double sBurstSeconds = 0.02;
+static const double sMinBurst = 64*1024;
+
+
+RWebTokenBucket::RWebTokenBucket(uint64_t bytesPerSecond)
+    : mRate(bytesPerSecond),
+      mBurst(std::max(sMinBurst, bytesPerSecond * sBurstSeconds)),
+      mMinSend(mBurst / 4),
+      mTokens(mBurst),
+      mLastRefill(Clock::now())
+{
+}
+
+void
+RWebTokenBucket::refill(Clock::time_point now)
+{
+    if (now <= mLastRefill) { return; }
+
+    double seconds = std::chrono::duration<double>(now - mLastRefill).count();
+    mTokens = std::min(mBurst, mTokens + seconds * mRate);
+    mLastRefill = now;
+}
+
+std::size_t
+RWebTokenBucket::available(Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    refill(now);
+    return mTokens >= mMinSend ? (std::size_t)mTokens : 0;
+}
+
+void
+RWebTokenBucket::consume(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTokens -= bytes;
+}
+
+RWebTokenBucket::Clock::time_point
+RWebTokenBucket::readyTime(Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    refill(now);
+    if (mTokens >= mMinSend) { return now; }
+
+    std::chrono::duration<double> wait((mMinSend - mTokens) / mRate);
+    return now + std::chrono::duration_cast<Clock::duration>(wait);
+}
+
+bool
+set_socket_pacing_rate(int socketFD, uint64_t bytesPerSecond)
+{
+#ifdef SO_MAX_PACING_RATE
+    // Older kernels only take 32 bits
+    unsigned int rate = std::min<uint64_t>(bytesPerSecond, UINT_MAX);
+    return setsockopt(socketFD, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0;
+#else
+    return false;
+#endif
+}
+
+std::size_t
+pacing_allowance(RWebConnection& connection, RWebTokenBucket* totalPacer, std::size_t maxBytes)
+{
+    if (!connection.pacer && !totalPacer) { return maxBytes; }
+
+    auto now = RWebTokenBucket::Clock::now();
+    std::size_t allowance = maxBytes;
+    for (RWebTokenBucket* pacer : {connection.pacer.get(), totalPacer})
+    {
+        if (!pacer) { continue; }
+
+        allowance = std::min(allowance, pacer->available(now));
+        if (allowance == 0)
+        {
+            connection.pacedUntil = pacer->readyTime(now);
+            return 0;
+        }
+    }
+    return allowance;
+}
+
+void
+pacing_consume(RWebConnection& connection, RWebTokenBucket* totalPacer, std::size_t bytes)
+{
+    if (connection.pacer) { connection.pacer->consume(bytes); }
+    if (totalPacer) { totalPacer->consume(bytes); }
+}
@@ -0,0 +1,137 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <stdlib.h>
+#include <string>
+
+#include "rweb/RWebPlaylist.h"
+
+
+static bool starts_with(std::string_view text, std::string_view prefix)
+{
+    return text.substr(0, prefix.size()) == prefix;
+}
+
+// Number after prefix, like "5" in "#EXT-X-MEDIA-SEQUENCE:5"
+static long number_after(std::string_view text, std::string_view prefix)
+{
+    return strtol(std::string(text.substr(prefix.size(), 20)).c_str(), nullptr, 10);
+}
+
+// Value of name in "a=1&b=2". Returns false if not found
+static bool query_value(std::string_view query, std::string_view name, long& value)
+{
+    while (!query.empty())
+    {
+        std::size_t end = query.find('&');
+        std::string_view parameter = query.substr(0, end);
+        if (parameter.size() > name.size() && starts_with(parameter, name) && parameter[name.size()] == '=')
+        {
+            char* numberEnd = nullptr;
+            std::string number(parameter.substr(name.size() + 1));
+            value = strtol(number.c_str(), &numberEnd, 10);
+            return *numberEnd == '\0' && value >= 0;
+        }
+        if (end == std::string_view::npos) { break; }
+        query.remove_prefix(end + 1);
+    }
+    return false;
+}
+
+bool parse_hls_blocking_request(std::string_view query, HlsBlockingRequest& request)
+{
+    request = HlsBlockingRequest();
+    if (!query_value(query, "_HLS_msn", request.mediaSequence)) { return false; }
+
+    if (!query_value(query, "_HLS_part", request.part))
+    {
+        request.part = -1;
+    }
+    return true;
+}
+
+// Segments and parts listed in a media playlist
+struct PlaylistPosition
+{
+    long nextSequence = 0;  // Segment being made now
+    long parts = 0;         // Parts of that segment
+    bool ended = false;
+};
+
+static PlaylistPosition playlist_position(std::string_view playlist)
+{
+    long firstSequence = 0;
+    long segments = 0;
+    PlaylistPosition position;
+
+    while (!playlist.empty())
+    {
+        std::size_t end = playlist.find('\n');
+        std::string_view line = playlist.substr(0, end);
+
+        if (starts_with(line, "#EXT-X-MEDIA-SEQUENCE:"))
+        {
+            firstSequence = number_after(line, "#EXT-X-MEDIA-SEQUENCE:");
+        }
+        else if (starts_with(line, "#EXTINF:"))
+        {
+            // The parts of a segment are listed before it
+            ++segments;
+            position.parts = 0;
+        }
+        else if (starts_with(line, "#EXT-X-PART:"))
+        {
+            ++position.parts;
+        }
+        else if (starts_with(line, "#EXT-X-ENDLIST"))
+        {
+            position.ended = true;
+            break;
+        }
+
+        if (end == std::string_view::npos) { break; }
+        playlist.remove_prefix(end + 1);
+    }
+
+    position.nextSequence = firstSequence + segments;
+    return position;
+}
+
+bool hls_playlist_has(std::string_view playlist, const HlsBlockingRequest& request)
+{
+    PlaylistPosition position = playlist_position(playlist);
+    if (position.ended || request.mediaSequence < position.nextSequence) { return true; }
+
+    return request.mediaSequence == position.nextSequence && request.part >= 0 && request.part < position.parts;
+}
+
+bool hls_request_too_far(std::string_view playlist, const HlsBlockingRequest& request)
+{
+    PlaylistPosition position = playlist_position(playlist);
+    long lastSequence = position.nextSequence - 1;
+
+    return !position.ended && request.mediaSequence > lastSequence + 2;
+}
+
+long hls_target_duration(std::string_view playlist, long defaultSeconds)
+{
+    std::size_t found = playlist.find("#EXT-X-TARGETDURATION:");
+    if (found == std::string_view::npos) { return defaultSeconds; }
+
+    long seconds = number_after(playlist.substr(found), "#EXT-X-TARGETDURATION:");
+    return seconds > 0 ? seconds : defaultSeconds;
+}
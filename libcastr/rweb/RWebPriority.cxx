@@ -0,0 +1,79 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/pkt_sched.h>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebPriority.h"
+#include "rweb/RWebUtils.h"
+
+// Largest file that is sent like an init segment
+static const off_t sInitSegmentMaxSize = 256*1024;
+
+// Largest file that is sent like a media segment. Larger files are
+// complete media files, played with progressive download.
+static const off_t sMediaSegmentMaxSize = 16*1024*1024;
+
+static const std::size_t sSendBudget[pr_Count] = {
+    (std::size_t)-1,    // pr_Manifest
+    (std::size_t)-1,    // pr_InitSegment
+    1024*1024,          // pr_MediaSegment
+    256*1024            // pr_WholeFile
+};
+
+// SO_PRIORITY values. Below 7, so no capability is needed.
+// pfifo_fast has 3 bands, Wi-Fi maps them to the VO, BE and BK categories.
+static const int sSocketPriority[pr_Count] = {
+    TC_PRIO_INTERACTIVE,    // pr_Manifest
+    TC_PRIO_INTERACTIVE,    // pr_InitSegment
+    TC_PRIO_BESTEFFORT,     // pr_MediaSegment
+    TC_PRIO_BULK            // pr_WholeFile
+};
+
+
+RWebPriority
+response_priority(std::string_view mimeType, off_t fileSize)
+{
+    if (equals_ignore_case(mimeType, "application/x-mpegurl")
+        || equals_ignore_case(mimeType, "application/vnd.apple.mpegurl")
+        || equals_ignore_case(mimeType, "application/dash+xml"))
+    {
+        return pr_Manifest;
+    }
+
+    if (fileSize <= sInitSegmentMaxSize) { return pr_InitSegment; }
+    if (fileSize <= sMediaSegmentMaxSize) { return pr_MediaSegment; }
+    return pr_WholeFile;
+}
+
+std::size_t
+send_budget(RWebPriority priority)
+{
+    return sSendBudget[priority];
+}
+
+void
+set_socket_priority(int socketFD, RWebPriority priority)
+{
+    int value = sSocketPriority[priority];
+    if (setsockopt(socketFD, SOL_SOCKET, SO_PRIORITY, &value, sizeof(value)) < 0)
+    {
+        RLOG(rlog::Verbose, "RWeb: SO_PRIORITY=" << value << " failed, errno=" << errno);
+    }
+}
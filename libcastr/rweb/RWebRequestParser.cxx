@@ -0,0 +1,311 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rweb/RWebRequestParser.h"
+#include "rweb/RWebUtils.h"
+
+
+// Returns pointer to first c in [begin, end), or end if not found
+static const char* find_char(const char* begin, const char* end, char c)
+{
+#if defined(__SSE2__)
+    // Compare 16 bytes at a time
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - begin >= 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0)
+        {
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 16;
+    }
+    while (begin < end && *begin != c) { ++begin; }
+    return begin;
+#else
+    // glibc memchr is vectorized on most other platforms
+    const void* found = memchr(begin, c, end - begin);
+    return found ? static_cast<const char*>(found) : end;
+#endif
+}
+
+static std::string_view trim_whitespace(std::string_view str)
+{
+    while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) { str.remove_prefix(1); }
+    while (!str.empty() && (str.back() == ' ' || str.back() == '\t')) { str.remove_suffix(1); }
+
+    return str;
+}
+
+static int hex_value(char x)
+{
+    if (x>='0' && x<='9') { return x - '0'; }
+    if (x>='a' && x<='f') { return x - 'a' + 10; }
+    if (x>='A' && x<='F') { return x - 'A' + 10; }
+
+    return -1;
+}
+
+
+std::string_view
+RWebRequest::header(std::string_view name) const
+{
+    for (std::size_t i=0; i<headerCount; ++i)
+    {
+        if (equals_ignore_case(headers[i].name, name))
+        {
+            return headers[i].value;
+        }
+    }
+
+    return std::string_view();
+}
+
+bool
+RWebRequest::headerHasToken(std::string_view name, std::string_view token) const
+{
+    std::string_view value = header(name);
+
+    while (!value.empty())
+    {
+        std::size_t comma = value.find(',');
+        if (equals_ignore_case(trim_whitespace(value.substr(0, comma)), token))
+        {
+            return true;
+        }
+        if (comma == std::string_view::npos) { break; }
+        value.remove_prefix(comma + 1);
+    }
+
+    return false;
+}
+
+
+void
+RWebRequestParser::reset()
+{
+    mScanOffset = 0;
+    mConsumedBytes = 0;
+}
+
+RWebRequestParser::Result
+RWebRequestParser::parse(std::string_view buffer, RWebRequest& request)
+{
+    const char* begin = buffer.data();
+    const char* end = begin + buffer.size();
+
+    // Empty lines before the request line are allowed
+    std::size_t start = 0;
+    while (start < buffer.size() && (buffer[start] == '\r' || buffer[start] == '\n')) { ++start; }
+    if (start == buffer.size()) { return pr_Incomplete; }
+
+    // Header ends with an empty line. Look at each line end we
+    // have not checked before.
+    const char* scan = begin + std::max(mScanOffset, start);
+    const char* headerEnd = nullptr;
+    while (headerEnd == nullptr)
+    {
+        const char* lineEnd = find_char(scan, end, '\n');
+        if (lineEnd == end)
+        {
+            mScanOffset = buffer.size();
+            break;
+        }
+
+        const char* next = lineEnd + 1;
+        if (next == end || (next[0] == '\r' && next+1 == end))
+        {
+            mScanOffset = lineEnd - begin;  // Check this line end again with more data
+            break;
+        }
+
+        if (next[0] == '\n')
+        {
+            headerEnd = next + 1;
+        }
+        else if (next[0] == '\r' && next[1] == '\n')
+        {
+            headerEnd = next + 2;
+        }
+        scan = next;
+    }
+
+    if (headerEnd == nullptr)
+    {
+        return (buffer.size() - start > sMaxHeaderSize) ? pr_Error : pr_Incomplete;
+    }
+
+    std::string_view header(begin + start, headerEnd - (begin + start));
+    if (header.size() > sMaxHeaderSize) { return pr_Error; }
+
+    mConsumedBytes = headerEnd - begin;
+    request.badRequest = !parseHeader(header, request);
+
+    return request.badRequest ? pr_Error : pr_Complete;
+}
+
+bool
+RWebRequestParser::parseHeader(std::string_view header, RWebRequest& request)
+{
+    request.raw = header;
+    request.method = request.target = request.query = request.path = std::string_view();
+    request.headerCount = 0;
+
+    const char* end = header.data() + header.size();
+    const char* lineStart = header.data();
+    bool isRequestLine = true;
+
+    while (lineStart < end)
+    {
+        const char* lineEnd = find_char(lineStart, end, '\n');
+        std::string_view line(lineStart, lineEnd - lineStart);
+        if (!line.empty() && line.back() == '\r') { line.remove_suffix(1); }
+        lineStart = lineEnd + 1;
+
+        if (line.empty()) { break; }    // End of header
+
+        if (isRequestLine)
+        {
+            // METHOD SP request-target SP HTTP/x.y
+            const char* lineEndPtr = line.data() + line.size();
+            const char* methodEnd = find_char(line.data(), lineEndPtr, ' ');
+            if (methodEnd == lineEndPtr || methodEnd == line.data()) { return false; }
+            const char* targetEnd = find_char(methodEnd + 1, lineEndPtr, ' ');
+            if (targetEnd == lineEndPtr || targetEnd == methodEnd + 1) { return false; }
+
+            request.method = std::string_view(line.data(), methodEnd - line.data());
+            request.target = std::string_view(methodEnd + 1, targetEnd - (methodEnd + 1));
+
+            std::string_view version(targetEnd + 1, lineEndPtr - (targetEnd + 1));
+            if (version.size() != 8 || version.substr(0,5) != "HTTP/" || version[6] != '.'
+                || version[5] < '0' || version[5] > '9' || version[7] < '0' || version[7] > '9')
+            {
+                return false;
+            }
+            request.versionMajor = version[5] - '0';
+            request.versionMinor = version[7] - '0';
+
+            isRequestLine = false;
+            continue;
+        }
+
+        // Folded header lines are obsolete and not supported
+        if (line[0] == ' ' || line[0] == '\t') { return false; }
+
+        std::size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0) { return false; }
+        if (request.headerCount == RWebRequest::sMaxHeaders) { return false; }
+
+        RWebHeader& item = request.headers[request.headerCount++];
+        item.name = line.substr(0, colon);
+        item.value = trim_whitespace(line.substr(colon + 1));
+        if (item.name.back() == ' ' || item.name.back() == '\t') { return false; }
+    }
+
+    // Absolute form "http://host/path" is allowed by HTTP/1.1
+    std::string_view path = request.target;
+    std::size_t schemeEnd = path.find("://");
+    if (schemeEnd != std::string_view::npos && path[0] != '/')
+    {
+        std::size_t pathStart = path.find('/', schemeEnd + 3);
+        path = (pathStart == std::string_view::npos) ? std::string_view("/") : path.substr(pathStart);
+    }
+    if (path.empty() || path[0] != '/') { return false; }
+
+    std::size_t fragmentStart = path.find('#');
+    path = path.substr(0, fragmentStart);
+    std::size_t queryStart = path.find('?');
+    if (queryStart != std::string_view::npos)
+    {
+        request.query = path.substr(queryStart + 1);
+        path = path.substr(0, queryStart);
+    }
+
+    std::size_t pathLength = normalize_path(path, request.pathStorage.data(), request.pathStorage.size());
+    if (pathLength == 0) { return false; }
+    request.path = std::string_view(request.pathStorage.data(), pathLength);
+
+    return true;
+}
+
+
+std::size_t
+normalize_path(std::string_view path, char* output, std::size_t maxLength)
+{
+    // Percent decode
+    std::size_t length = 0;
+    for (std::size_t i=0; i<path.size(); ++i)
+    {
+        char x = path[i];
+        if (x == '%')
+        {
+            if (i+2 >= path.size()) { return 0; }
+            int high = hex_value(path[i+1]);
+            int low = hex_value(path[i+2]);
+            if (high < 0 || low < 0) { return 0; }
+            x = static_cast<char>(high*16 + low);
+            i += 2;
+        }
+        if (x == '\0' || length == maxLength) { return 0; }
+        output[length++] = x;
+    }
+
+    // Resolve segments in place. Output is never longer than input
+    std::size_t in = 0;
+    std::size_t out = 0;
+    bool trailingSlash = false;
+    while (in < length)
+    {
+        while (in < length && output[in] == '/') { ++in; }
+        std::size_t segmentStart = in;
+        while (in < length && output[in] != '/') { ++in; }
+        std::string_view segment(output + segmentStart, in - segmentStart);
+
+        trailingSlash = (in == length && segment.empty()) || segment == "." || segment == "..";
+        if (segment.empty() || segment == ".")
+        {
+            continue;
+        }
+        if (segment == "..")
+        {
+            if (out == 0) { return 0; }     // Above root
+            while (out > 0 && output[out-1] != '/') { --out; }
+            --out;
+            continue;
+        }
+
+        output[out++] = '/';
+        memmove(output + out, output + segmentStart, segment.size());
+        out += segment.size();
+    }
+
+    if (trailingSlash || out == 0)
+    {
+        if (out == maxLength) { return 0; }
+        output[out++] = '/';
+    }
+
+    return out;
+}
@@ -0,0 +1,75 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebSocketOptions.h"
+
+
+static void set_option(int fd, int level, int option, int value, const char* name)
+{
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0)
+    {
+        RLOG(rlog::Important, "RWeb: socket option " << name << "=" << value
+                              << " not supported, errno=" << errno);
+    }
+}
+
+void
+apply_listen_socket_options(int listenFD, const RWebSocketOptions& options)
+{
+    if (options.deferAcceptSeconds > 0)
+    {
+        set_option(listenFD, IPPROTO_TCP, TCP_DEFER_ACCEPT, options.deferAcceptSeconds, "TCP_DEFER_ACCEPT");
+    }
+    if (options.fastOpenQueueLength > 0)
+    {
+        set_option(listenFD, IPPROTO_TCP, TCP_FASTOPEN, options.fastOpenQueueLength, "TCP_FASTOPEN");
+    }
+    if (!options.congestionControl.empty())
+    {
+        const std::string& algorithm = options.congestionControl;
+        if (setsockopt(listenFD, IPPROTO_TCP, TCP_CONGESTION, algorithm.c_str(), algorithm.size()) < 0)
+        {
+            RLOG(rlog::Important, "RWeb: congestion control " << algorithm
+                                  << " not available, errno=" << errno);
+        }
+    }
+}
+
+void
+apply_connection_socket_options(int socketFD, const RWebSocketOptions& options)
+{
+    if (options.sendBufferSize > 0)
+    {
+        set_option(socketFD, SOL_SOCKET, SO_SNDBUF, options.sendBufferSize, "SO_SNDBUF");
+    }
+}
+
+void
+set_socket_cork(int socketFD, const RWebSocketOptions& options, bool cork)
+{
+    if (!options.cork) { return; }
+
+    int value = cork ? 1 : 0;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
@@ -0,0 +1,516 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebTailFollower.h"
+#include "rweb/RWebUtils.h"
+
+// A file is growing from its first write until the writer closes it.
+// Files moved into the folder are complete, like playlists written with rename()
+static const uint32_t sWatchMask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE
+                                 | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+// stop() is noticed within this time
+static const int sWaitTimeoutMs = 200;
+
+static const int sMaxEvents = 64;
+
+// Max bytes moved by one splice call
+static const std::size_t sCopySize = 1024*1024;
+
+// Lets the follower copy a whole segment while the client is slow. The default is 64 kB
+static const int sPipeSize = 1024*1024;
+
+// Blocking playlist reloads wait 3 target durations at most. A larger
+// target in the playlist does not make them wait longer
+static const long sDefaultTargetDuration = 2;
+static const long sMaxTargetDuration = 10;
+
+// Larger playlists are not checked, and sent when the wait times out
+static const std::size_t sMaxPlaylistSize = 1024*1024;
+
+// Written files with this suffix are renamed to the name without it when complete
+static const std::string sTempSuffix = ".tmp";
+
+
+// Same file, same string. Both ".//seg.m4s" and "./seg.m4s" are "seg.m4s"
+static std::string normalized(const std::string& path)
+{
+    return std::filesystem::path(path).lexically_normal().string();
+}
+
+static bool read_playlist(int fd, std::string& content)
+{
+    char buffer[64*1024];
+    while (content.size() < sMaxPlaylistSize)
+    {
+        ssize_t ret = read(fd, buffer, sizeof(buffer));
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret < 0) { return false; }
+        if (ret == 0) { return true; }
+        content.append(buffer, ret);
+    }
+    return false;
+}
+
+
+RWebTailFollower::RWebTailFollower(const std::string& folder)
+  : mFolder(folder)
+{
+}
+
+RWebTailFollower::~RWebTailFollower()
+{
+    stop();
+}
+
+bool
+RWebTailFollower::start()
+{
+    mInotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mInotifyFD < 0 || mEpollFD < 0 || inotify_add_watch(mInotifyFD, mFolder.c_str(), sWatchMask) < 0)
+    {
+        RLOG(rlog::Important, "RWebTailFollower: can not watch " << mFolder << ", errno=" << errno
+                              << ". Growing files are sent as they are");
+        stop();
+        return false;
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = mInotifyFD;
+    epoll_ctl(mEpollFD, EPOLL_CTL_ADD, mInotifyFD, &event);
+
+    mRunning = true;
+    mThread = std::thread(
+        [this](){
+            this->loop();
+        }
+    );
+    return true;
+}
+
+void
+RWebTailFollower::stop()
+{
+    if (mThread.joinable())
+    {
+        mRunning = false;
+        mThread.join();
+    }
+
+    // Closed pipes end the bodies. Later calls of follow() fail
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& item : mFollowers)
+    {
+        close(item.second.pipeFD);
+        close(item.second.fileFD);
+    }
+    mFollowers.clear();
+    for (auto& item : mPlaylistWaiters)
+    {
+        close(item.second.pipeFD);
+    }
+    mPlaylistWaiters.clear();
+    mGrowing.clear();
+
+    if (mInotifyFD >= 0)
+    {
+        close(mInotifyFD);
+        mInotifyFD = -1;
+    }
+    if (mEpollFD >= 0)
+    {
+        close(mEpollFD);
+        mEpollFD = -1;
+    }
+}
+
+std::string
+RWebTailFollower::growingFile(const std::string& internalPath)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mGrowing.empty()) { return ""; }
+
+    auto found = mGrowing.find(normalized(internalPath));
+    return found != mGrowing.end() ? found->second : "";
+}
+
+// Pipe with non-blocking write end for the loop thread
+bool
+RWebTailFollower::createPipe(int fds[2])
+{
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+        RLOG(rlog::Critical, "ERROR: RWebTailFollower: pipe failed, errno=" << errno);
+        return false;
+    }
+    if (fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0)
+    {
+        RLOG(rlog::Critical, "ERROR: RWebTailFollower: pipe setup failed, errno=" << errno);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, sPipeSize);
+    return true;
+}
+
+int
+RWebTailFollower::follow(const std::string& internalPath, int fd)
+{
+    int fds[2];
+    if (!createPipe(fds)) { return -1; }
+
+    Follower follower;
+    follower.path = normalized(internalPath);
+    follower.fileFD = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    follower.pipeFD = fds[1];
+    if (follower.fileFD < 0)
+    {
+        RLOG(rlog::Critical, "ERROR: RWebTailFollower: follow " << internalPath << " failed, errno=" << errno);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRunning)
+    {
+        close(follower.fileFD);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    // The writer may have closed the file since growingFile()
+    follower.writerClosed = (mGrowing.count(follower.path) == 0);
+    mFollowers[fds[1]] = follower;
+
+    // An empty pipe is writable, so the file so far is copied right away
+    struct epoll_event event = {};
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.fd = fds[1];
+    epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fds[1], &event);
+
+    RLOG(rlog::Verbose, "RWebTailFollower: follow " << follower.path);
+    return fds[0];
+}
+
+int
+RWebTailFollower::waitForPlaylist(const std::string& internalPath, const HlsBlockingRequest& position)
+{
+    int fds[2];
+    if (!createPipe(fds)) { return -1; }
+
+    PlaylistWaiter waiter;
+    waiter.path = normalized(internalPath);
+    waiter.position = position;
+    waiter.pipeFD = fds[1];
+
+    long targetDuration = sDefaultTargetDuration;
+    int fd = open(waiter.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        std::string playlist;
+        read_playlist(fd, playlist);
+        targetDuration = std::min(hls_target_duration(playlist, sDefaultTargetDuration), sMaxTargetDuration);
+        close(fd);
+    }
+    waiter.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(3 * targetDuration);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRunning)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    // Also tells when the client goes away while it waits
+    struct epoll_event event = {};
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.fd = fds[1];
+    epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fds[1], &event);
+
+    if (!releaseWaiter(waiter, false))
+    {
+        RLOG(rlog::Verbose, "RWebTailFollower: " << waiter.path << " waits for segment "
+             << position.mediaSequence << " part " << position.part);
+        mPlaylistWaiters[fds[1]] = waiter;
+    }
+    return fds[0];
+}
+
+void
+RWebTailFollower::loop()
+{
+    // Copying into a pipe that the client has closed raises SIGPIPE.
+    // Blocked here, so the copy fails with EPIPE instead
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+    struct epoll_event events[sMaxEvents];
+
+    while (mRunning)
+    {
+        int eventCount = epoll_wait(mEpollFD, events, sMaxEvents, sWaitTimeoutMs);
+
+        // Data just written is in the page cache, so copies under the lock are short
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (int i=0; i<eventCount; ++i)
+        {
+            if (events[i].data.fd == mInotifyFD)
+            {
+                readEvents();
+            }
+            else
+            {
+                followerEvent(events[i].data.fd, events[i].events);
+            }
+        }
+        if (!mPlaylistWaiters.empty())
+        {
+            releaseWaiters(nullptr);
+        }
+
+        // Drop the SIGPIPE of clients that have gone
+        struct timespec noWait = {};
+        while (sigtimedwait(&sigpipe, nullptr, &noWait) > 0) {}
+    }
+}
+
+void
+RWebTailFollower::readEvents()
+{
+    alignas(struct inotify_event) char buffer[4096];
+
+    while (true)
+    {
+        ssize_t length = read(mInotifyFD, buffer, sizeof(buffer));
+        if (length <= 0) { return; }
+
+        for (char* position = buffer; position < buffer + length; )
+        {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(position);
+            position += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Closes may be lost. End all followers rather than wait forever
+                RLOG(rlog::Important, "RWebTailFollower: inotify queue overflow");
+                std::vector<std::string> paths;
+                for (const auto& item : mGrowing)
+                {
+                    paths.push_back(item.first);
+                }
+                mGrowing.clear();
+                for (const std::string& path : paths)
+                {
+                    fileChanged(path);
+                }
+                continue;
+            }
+            if (event->len == 0 || (event->mask & IN_ISDIR)) { continue; }
+
+            // Clients ask for "seg.m4s" while the encoder writes "seg.m4s.tmp"
+            std::string writtenPath = normalized(mFolder + "/" + event->name);
+            std::string path = writtenPath;
+            if (ends_with(path, sTempSuffix) && path.size() > sTempSuffix.size())
+            {
+                path.resize(path.size() - sTempSuffix.size());
+            }
+
+            if (event->mask & (IN_CREATE | IN_MODIFY))
+            {
+                mGrowing[path] = writtenPath;
+            }
+            if (event->mask & (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM))
+            {
+                auto found = mGrowing.find(path);
+                if (found != mGrowing.end() && found->second == writtenPath)
+                {
+                    mGrowing.erase(found);
+                }
+            }
+            fileChanged(path);
+        }
+    }
+}
+
+// Copy new data of the file to the pipes that follow it
+void
+RWebTailFollower::fileChanged(const std::string& path)
+{
+    if (!mPlaylistWaiters.empty())
+    {
+        releaseWaiters(&path);
+    }
+    if (mFollowers.empty()) { return; }
+
+    bool growing = mGrowing.count(path) > 0;
+    std::vector<int> done;
+    for (auto& item : mFollowers)
+    {
+        Follower& follower = item.second;
+        if (follower.path != path) { continue; }
+
+        follower.writerClosed = !growing;
+        if (!copyNewData(follower))
+        {
+            done.push_back(item.first);
+        }
+    }
+    for (int pipeFD : done)
+    {
+        removeFollower(pipeFD);
+    }
+}
+
+// The pipe has room again, or the client has closed it
+void
+RWebTailFollower::followerEvent(int pipeFD, uint32_t events)
+{
+    auto waiting = mPlaylistWaiters.find(pipeFD);
+    if (waiting != mPlaylistWaiters.end())
+    {
+        if (events & EPOLLERR)
+        {
+            close(pipeFD);
+            mPlaylistWaiters.erase(waiting);
+        }
+        return;
+    }
+
+    auto found = mFollowers.find(pipeFD);
+    if (found == mFollowers.end()) { return; }
+
+    if ((events & EPOLLERR) || !copyNewData(found->second))
+    {
+        removeFollower(pipeFD);
+    }
+}
+
+// Returns false when the follower is done. Either the writer has closed
+// the file and all of it is copied, or the client has gone
+bool
+RWebTailFollower::copyNewData(Follower& follower)
+{
+    while (true)
+    {
+        ssize_t ret = splice(follower.fileFD, &follower.offset, follower.pipeFD, nullptr,
+                             sCopySize, SPLICE_F_NONBLOCK);
+        if (ret > 0) { continue; }
+        if (ret == 0) { return !follower.writerClosed; }     // At the end of what is written
+        if (errno == EINTR) { continue; }
+        if (errno == EAGAIN) { return true; }  // Pipe full. Continue on EPOLLOUT
+
+        if (errno != EPIPE)
+        {
+            RLOG(rlog::Important, "RWebTailFollower: copy of " << follower.path << " failed, errno=" << errno);
+        }
+        return false;
+    }
+}
+
+// Closing the pipe ends the body
+void
+RWebTailFollower::removeFollower(int pipeFD)
+{
+    auto found = mFollowers.find(pipeFD);
+    if (found == mFollowers.end()) { return; }
+
+    RLOG(rlog::Verbose, "RWebTailFollower: " << found->second.path << " done, "
+         << found->second.offset << " bytes");
+    close(found->second.pipeFD);
+    close(found->second.fileFD);
+    mFollowers.erase(found);
+}
+
+// Start sending the playlist when it has what the waiter asks for, or when
+// the wait has timed out. Returns false if the waiter must wait more
+bool
+RWebTailFollower::releaseWaiter(const PlaylistWaiter& waiter, bool timedOut)
+{
+    // A playlist written in place is checked when the writer closes it
+    bool growing = mGrowing.count(waiter.path) > 0;
+    if (growing && !timedOut) { return false; }
+
+    // The playlist is checked and sent from the same open file,
+    // also if a new version is renamed into place meanwhile
+    int fd = open(waiter.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!timedOut)
+    {
+        std::string playlist;
+        if (fd < 0 || !read_playlist(fd, playlist) || !hls_playlist_has(playlist, waiter.position))
+        {
+            if (fd >= 0) { close(fd); }
+            return false;
+        }
+    }
+    if (fd < 0)
+    {
+        close(waiter.pipeFD);   // Empty body
+        return true;
+    }
+
+    Follower follower;
+    follower.path = waiter.path;
+    follower.fileFD = fd;
+    follower.pipeFD = waiter.pipeFD;
+    follower.writerClosed = !growing;
+    mFollowers[waiter.pipeFD] = follower;
+    if (!copyNewData(mFollowers[waiter.pipeFD]))
+    {
+        removeFollower(waiter.pipeFD);
+    }
+    return true;
+}
+
+// Check the waiters of the playlist at path after it changed,
+// or the deadlines of all waiters if path is nullptr
+void
+RWebTailFollower::releaseWaiters(const std::string* path)
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = mPlaylistWaiters.begin(); it != mPlaylistWaiters.end(); )
+    {
+        const PlaylistWaiter& waiter = it->second;
+        bool timedOut = now >= waiter.deadline;
+        bool check = path ? (waiter.path == *path) : timedOut;
+        if (check && releaseWaiter(waiter, timedOut))
+        {
+            it = mPlaylistWaiters.erase(it);
+            continue;
+        }
+        ++it;
+    }
+}
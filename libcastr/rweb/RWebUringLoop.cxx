@@ -0,0 +1,1049 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "rlog/RLog.h"
+#include "rweb/RWebUringLoop.h"
+#include "rweb/RWebUtils.h"
+#include "rweb/RWebWorkerPool.h"
+
+#define BUFSIZE 8096
+
+static const unsigned sRingEntries = 4096;
+static const int sTimerIntervalMs = 500;
+
+// Max bytes read from the body file before it is sent
+static const off_t sReadChunkSize = 256*1024;
+
+// Kernel features we need. Fast poll (5.7) makes socket operations
+// cheap, and the same kernels have accept, send, recv and read.
+static const uint32_t sRequiredFeatures = IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS
+                                        | IORING_FEAT_FAST_POLL;
+
+// user_data of an operation is key << 8 | operation.
+// The key is the socket fd, or the accept slot.
+static uint64_t make_user_data(uint64_t key, int operation)
+{
+    return (key << 8) | operation;
+}
+
+
+RWebUringLoop::RWebUringLoop(int listenFD, RequestHandler requestHandler,
+                             RWebWorkerPool* workerPool, RWebClientLimiter* clientLimiter)
+  : mListenFD(listenFD),
+    mRequestHandler(requestHandler),
+    mWorkerPool(workerPool),
+    mClientLimiter(clientLimiter)
+{
+    static_assert(sizeof(TimerSpec) == sizeof(struct __kernel_timespec), "TimerSpec must match kernel");
+}
+
+RWebUringLoop::~RWebUringLoop()
+{
+    stop();
+}
+
+bool
+RWebUringLoop::start()
+{
+    if (!setupRing(sRingEntries))
+    {
+        closeRing();
+        return false;
+    }
+
+    mWakeFD = eventfd(0, EFD_CLOEXEC);
+    if (mWakeFD < 0)
+    {
+        RLOG(rlog::Critical, "ERROR: RWebUringLoop failed to create eventfd, errno=" << errno);
+        closeRing();
+        return false;
+    }
+
+    mRunning = true;
+    mThread = std::thread(
+        [this](){
+            this->loop();
+        }
+    );
+    if (mCpu >= 0 && !pin_thread_to_cpu(mThread, mCpu))
+    {
+        RLOG(rlog::Important, "RWebUringLoop: failed to pin thread to cpu " << mCpu);
+    }
+
+    return true;
+}
+
+void
+RWebUringLoop::stop()
+{
+    if (mThread.joinable())
+    {
+        mRunning = false;
+        uint64_t wake = 1;
+        (void)write(mWakeFD, &wake, sizeof(wake));
+        mThread.join();
+    }
+
+    closeRing();
+    if (mWakeFD >= 0) { close(mWakeFD); }
+    mWakeFD = -1;
+}
+
+bool
+RWebUringLoop::setupRing(unsigned entries)
+{
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;    // Room for a completion from every connection
+
+    mRingFD = syscall(__NR_io_uring_setup, entries, &params);
+    if (mRingFD < 0)
+    {
+        RLOG(rlog::Important, "RWebUringLoop: io_uring_setup failed, errno=" << errno);
+        return false;
+    }
+    if ((params.features & sRequiredFeatures) != sRequiredFeatures)
+    {
+        RLOG(rlog::Important, "RWebUringLoop: io_uring in this kernel is too old. Features=" << params.features);
+        return false;
+    }
+
+    mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap)
+    {
+        mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+    }
+
+    mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   mRingFD, IORING_OFF_SQ_RING);
+    if (mSqRing == MAP_FAILED)
+    {
+        mSqRing = nullptr;
+        RLOG(rlog::Critical, "ERROR: RWebUringLoop failed to map ring, errno=" << errno);
+        return false;
+    }
+
+    mCqRing = mSqRing;
+    if (!singleMap)
+    {
+        mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       mRingFD, IORING_OFF_CQ_RING);
+        if (mCqRing == MAP_FAILED)
+        {
+            mCqRing = nullptr;
+            RLOG(rlog::Critical, "ERROR: RWebUringLoop failed to map ring, errno=" << errno);
+            return false;
+        }
+    }
+
+    mSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      mRingFD, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        RLOG(rlog::Critical, "ERROR: RWebUringLoop failed to map ring, errno=" << errno);
+        return false;
+    }
+    mSqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(mSqRing);
+    char* cq = static_cast<char*>(mCqRing);
+    mSqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    mSqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    mSqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    mSqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    mSqEntries = params.sq_entries;
+    mCqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    mCqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    mCqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    mCqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    mSqLocalTail = *mSqTail;
+    mSqSubmitted = mSqLocalTail;
+
+    RLOG(rlog::Verbose, "RWebUringLoop: ring with " << params.sq_entries << " entries");
+    return true;
+}
+
+void
+RWebUringLoop::closeRing()
+{
+    if (mSqes) { munmap(mSqes, mSqesSize); }
+    if (mCqRing && mCqRing != mSqRing) { munmap(mCqRing, mCqRingSize); }
+    if (mSqRing) { munmap(mSqRing, mSqRingSize); }
+    if (mRingFD >= 0) { close(mRingFD); }
+    mSqes = nullptr;
+    mCqRing = nullptr;
+    mSqRing = nullptr;
+    mRingFD = -1;
+}
+
+// Returns a cleared submission entry, or nullptr if the ring is full
+struct io_uring_sqe*
+RWebUringLoop::getSqe(Operation operation, uint64_t key)
+{
+    unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+    if (mSqLocalTail - head >= mSqEntries)
+    {
+        submit(0);
+        head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+        if (mSqLocalTail - head >= mSqEntries)
+        {
+            RLOG(rlog::Critical, "ERROR: RWebUringLoop submission ring full");
+            return nullptr;
+        }
+    }
+
+    unsigned index = mSqLocalTail & mSqMask;
+    struct io_uring_sqe* sqe = &mSqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = make_user_data(key, operation);
+    mSqArray[index] = index;
+    ++mSqLocalTail;
+
+    return sqe;
+}
+
+// Submit all queued entries and wait for waitCount completions
+int
+RWebUringLoop::submit(unsigned waitCount)
+{
+    __atomic_store_n(mSqTail, mSqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, mRingFD, mSqLocalTail - mSqSubmitted, waitCount, flags, nullptr, 0);
+    if (ret > 0)
+    {
+        mSqSubmitted += ret;
+    }
+
+    return ret;
+}
+
+void
+RWebUringLoop::loop()
+{
+    RLOG(rlog::Verbose, "Server uring loop start");
+
+    for (int slot=0; slot<sAcceptsInFlight; ++slot)
+    {
+        queueAccept(slot);
+    }
+    queueWake();
+    queueTimer();
+
+    while (mRunning || !mConnections.empty())
+    {
+        queuePaceTimer();
+        if (submit(1) < 0 && errno != EINTR && errno != EBUSY)
+        {
+            RLOG(rlog::Critical, "ERROR: io_uring_enter, errno=" << errno);
+            break;
+        }
+
+        unsigned head = *mCqHead;
+        while (head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = mCqes[head & mCqMask];
+            ++head;
+            __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+
+            onCompletion(cqe);
+        }
+        sendScheduledConnections();
+
+        if (!mRunning)
+        {
+            // Pending recv and send end when the sockets are shut down.
+            // Buffers are freed when their operations have completed.
+            for (auto& item : mConnections)
+            {
+                closeConnection(*item.second);
+            }
+        }
+        releaseClosedConnections();
+    }
+
+    RLOG(rlog::Verbose, "Server uring loop finished");
+}
+
+void
+RWebUringLoop::onCompletion(const struct io_uring_cqe& cqe)
+{
+    int operation = cqe.user_data & 0xff;
+    int key = cqe.user_data >> 8;
+
+    switch (operation)
+    {
+    case op_Accept:
+        onAccept(key, cqe.res);
+        return;
+    case op_Wake:
+        if (mRunning) { queueWake(); }
+        onHandled();
+        return;
+    case op_Timer:
+        queueTimer();   // Also while stopping, so the loop never waits forever
+        closeExpiredConnections();
+        return;
+    case op_PaceTimer:
+        mPaceTimerQueued = false;
+        resumePacedConnections();
+        return;
+    case op_Cancel:
+        return;     // The canceled read completes with -ECANCELED
+    }
+
+    auto it = mConnections.find(key);
+    if (it == mConnections.end())
+    {
+        RLOG(rlog::Critical, "ERROR: RWebUringLoop completion for unknown connection fd=" << key);
+        return;
+    }
+    UringConnection& uringConnection = *it->second;
+    --uringConnection.pendingOperations;
+
+    switch (operation)
+    {
+    case op_Recv:
+        onRecv(uringConnection, cqe.res);
+        break;
+    case op_Send:
+        onSend(uringConnection, cqe.res);
+        break;
+    case op_ReadBody:
+        onReadBody(uringConnection, cqe.res);
+        break;
+    }
+
+    if (uringConnection.connection.state == RWebConnection::cs_Closed)
+    {
+        closeConnection(uringConnection);
+    }
+}
+
+void
+RWebUringLoop::queueAccept(int slot)
+{
+    mAcceptAddressLength[slot] = sizeof(mAcceptAddress[slot]);
+
+    struct io_uring_sqe* sqe = getSqe(op_Accept, slot);
+    if (!sqe) { return; }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = mListenFD;
+    sqe->addr = reinterpret_cast<uint64_t>(&mAcceptAddress[slot]);
+    sqe->addr2 = reinterpret_cast<uint64_t>(&mAcceptAddressLength[slot]);
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void
+RWebUringLoop::queueRecv(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+    if (uringConnection.recvPending || uringConnection.closing) { return; }
+
+    struct io_uring_sqe* sqe = getSqe(op_Recv, connection.fd);
+    if (!sqe)
+    {
+        connection.state = RWebConnection::cs_Closed;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(uringConnection.recvBuffer.data());
+    sqe->len = uringConnection.recvBuffer.size();
+    uringConnection.recvPending = true;
+    ++uringConnection.pendingOperations;
+}
+
+void
+RWebUringLoop::queueSend(UringConnection& uringConnection, const char* data, std::size_t size, bool more)
+{
+    RWebConnection& connection = uringConnection.connection;
+
+    struct io_uring_sqe* sqe = getSqe(op_Send, connection.fd);
+    if (!sqe)
+    {
+        connection.state = RWebConnection::cs_Closed;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = size;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    uringConnection.sendPending = true;
+    ++uringConnection.pendingOperations;
+}
+
+void
+RWebUringLoop::queueReadBody(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+
+    struct io_uring_sqe* sqe = getSqe(op_ReadBody, connection.fd);
+    if (!sqe)
+    {
+        connection.state = RWebConnection::cs_Closed;
+        return;
+    }
+
+    std::size_t size = sReadChunkSize;
+    char* block = connection.prepareBodyRead(size);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = connection.bodyFD;
+    sqe->addr = reinterpret_cast<uint64_t>(block);
+    sqe->len = size;
+    // Files are read at bodyOffset. Pipes from where they are
+    sqe->off = connection.bodyFile ? connection.bodyOffset : (uint64_t)-1;
+    uringConnection.sendPending = true;
+    uringConnection.readBodyPending = true;
+    ++uringConnection.pendingOperations;
+}
+
+// A read from a body pipe waits until the producer writes, which may be
+// much later or never. Shutting down the socket does not end it
+void
+RWebUringLoop::queueCancelReadBody(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+
+    struct io_uring_sqe* sqe = getSqe(op_Cancel, connection.fd);
+    if (!sqe) { return; }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(connection.fd, op_ReadBody);
+}
+
+void
+RWebUringLoop::queueWake()
+{
+    struct io_uring_sqe* sqe = getSqe(op_Wake, 0);
+    if (!sqe) { return; }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = mWakeFD;
+    sqe->addr = reinterpret_cast<uint64_t>(&mWakeValue);
+    sqe->len = sizeof(mWakeValue);
+    sqe->off = (uint64_t)-1;
+}
+
+void
+RWebUringLoop::queueTimer()
+{
+    struct io_uring_sqe* sqe = getSqe(op_Timer, 0);
+    if (!sqe) { return; }
+
+    mTimerSpec.seconds = 0;
+    mTimerSpec.nanoseconds = sTimerIntervalMs * 1000000LL;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&mTimerSpec);
+    sqe->len = 1;
+}
+
+void
+RWebUringLoop::onAccept(int slot, int result)
+{
+    // The next accept of the slot writes to the same address buffer,
+    // also before this call returns if the submission ring is full
+    struct sockaddr_storage clientAddress = mAcceptAddress[slot];
+    if (mRunning)
+    {
+        queueAccept(slot);
+    }
+
+    if (result < 0)
+    {
+        if (result != -EINTR && result != -EAGAIN && result != -ECANCELED)
+        {
+            RLOG(rlog::Critical, "ERROR: socket accept, errno=" << -result);
+        }
+        return;
+    }
+    int socketfd = result;
+    if (!mRunning)
+    {
+        close(socketfd);
+        return;
+    }
+
+    // Responses are written in few large sends, so Nagle only adds
+    // delay between pipelined responses on keep-alive connections.
+    int noDelay = 1;
+    setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    apply_connection_socket_options(socketfd, mSocketOptions);
+
+    auto uringConnection = std::make_unique<UringConnection>();
+    uringConnection->recvBuffer.resize(BUFSIZE);
+    RWebConnection& connection = uringConnection->connection;
+    connection.fd = socketfd;
+    connection.clientAddress = socket_address_to_string(clientAddress);
+    connection.connectionId = mNextConnectionId++;
+    connection.requestBuffer.reserve(BUFSIZE);
+    connection.lastActivity = std::chrono::steady_clock::now();
+    startPacing(connection);
+
+    RLOG(rlog::Verbose, "Accepted connection #" << connection.connectionId
+                        << " from " << connection.clientAddress);
+
+    UringConnection& added = *uringConnection;
+    mConnections[socketfd] = std::move(uringConnection);
+    mActiveConnections.add(1);
+
+    if (mClientLimiter && !mClientLimiter->acquire(connection.clientAddress))
+    {
+        // Too many connections from this client. Answer 503 and close
+        connection.clientAddress.clear();    // Nothing to release
+        connection.requestStart = connection.lastActivity;
+        connection.responseHead = sServiceUnavailableMessage;
+        connection.state = RWebConnection::cs_SendingResponse;
+        sendMore(added);
+    }
+    else
+    {
+        queueRecv(added);
+    }
+
+    if (connection.state == RWebConnection::cs_Closed)
+    {
+        closeConnection(added);
+    }
+}
+
+void
+RWebUringLoop::onRecv(UringConnection& uringConnection, int result)
+{
+    RWebConnection& connection = uringConnection.connection;
+    uringConnection.recvPending = false;
+
+    if (uringConnection.closing) { return; }
+
+    if (connection.state == RWebConnection::cs_Handling)
+    {
+        // The worker uses requestBuffer. Data waits in recvBuffer
+        uringConnection.recvDelayed = true;
+        uringConnection.delayedRecvResult = result;
+        return;
+    }
+
+    if (result > 0)
+    {
+        connection.lastActivity = std::chrono::steady_clock::now();
+        if (connection.state == RWebConnection::cs_Draining)
+        {
+            // Data after the last response is ignored
+        }
+        else if (connection.requestBuffer.size() >= sMaxRequestBufferSize)
+        {
+            // Client sends more than we want to buffer. Close after this response
+            connection.keepAlive = false;
+        }
+        else
+        {
+            connection.requestBuffer.append(uringConnection.recvBuffer.data(), result);
+        }
+
+        startNextRequest(uringConnection);
+        if (connection.state != RWebConnection::cs_Handling)
+        {
+            queueRecv(uringConnection);
+        }
+        return;
+    }
+
+    if (result == 0)   // Client closed its end
+    {
+        connection.keepAlive = false;
+        if (connection.state != RWebConnection::cs_SendingResponse)
+        {
+            connection.state = RWebConnection::cs_Closed;
+        }
+        return;
+    }
+
+    if (result == -EINTR || result == -EAGAIN)
+    {
+        queueRecv(uringConnection);
+        return;
+    }
+
+    connection.state = RWebConnection::cs_Closed;
+}
+
+void
+RWebUringLoop::onSend(UringConnection& uringConnection, int result)
+{
+    RWebConnection& connection = uringConnection.connection;
+    uringConnection.sendPending = false;
+
+    if (uringConnection.closing) { return; }
+
+    if (result < 0)
+    {
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            sendMore(uringConnection);
+            return;
+        }
+        RLOG_N(connection.connectionId << ": SEND failed, errno=" << -result);
+        connection.state = RWebConnection::cs_Closed;
+        return;
+    }
+
+    connection.lastActivity = std::chrono::steady_clock::now();
+    mBytesSent.add(result);
+    if (connection.responseHeadSent < connection.responseHead.size())
+    {
+        connection.responseHeadSent += result;
+    }
+    else
+    {
+        connection.bodyDataSent += result;
+        connection.bytesSentCopied += result;
+        pacing_consume(connection, mTotalPacer, result);
+    }
+
+    scheduleSend(uringConnection);
+}
+
+void
+RWebUringLoop::onReadBody(UringConnection& uringConnection, int result)
+{
+    RWebConnection& connection = uringConnection.connection;
+    uringConnection.sendPending = false;
+    uringConnection.readBodyPending = false;
+
+    if (uringConnection.closing) { return; }
+
+    if (result < 0 || (result == 0 && !connection.bodyUntilEnd))
+    {
+        // File shorter than the Content-Length we have sent. Client must see an error
+        RLOG(rlog::Critical, connection.connectionId << ": ERROR: body read failed, result=" << result);
+        connection.state = RWebConnection::cs_Closed;
+        return;
+    }
+
+    connection.bodyReadDone(result);
+
+    scheduleSend(uringConnection);
+}
+
+void
+RWebUringLoop::startNextRequest(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+    if (connection.state != RWebConnection::cs_ReadingRequest) { return; }
+
+    RWebRequestParser& parser = connection.requestParser;
+    RWebRequestParser::Result result = parser.parse(connection.requestBuffer, connection.request);
+    if (result == RWebRequestParser::pr_Incomplete) { return; }
+
+    connection.requestStart = std::chrono::steady_clock::now();
+    connection.request.badRequest = (result == RWebRequestParser::pr_Error);
+    connection.keepAlive = false;
+
+    if (mWorkerPool && !connection.request.badRequest)
+    {
+        // The loop does not touch the connection until the worker is done.
+        connection.state = RWebConnection::cs_Handling;
+        RWebConnection* connectionPtr = &connection;
+        int fd = connection.fd;
+        bool queued = mWorkerPool->submit(
+            [this, connectionPtr, fd](){
+                mRequestHandler(*connectionPtr);
+                postHandled(fd);
+            }
+        );
+        if (queued) { return; }
+
+        RLOG(rlog::Important, connection.connectionId << ": Worker queue full. Respond 503");
+        connection.state = RWebConnection::cs_ReadingRequest;
+        connection.responseHead = sServiceUnavailableMessage;
+    }
+    else
+    {
+        mRequestHandler(connection);
+    }
+
+    requestHandled(uringConnection, connection.request.badRequest);
+}
+
+void
+RWebUringLoop::requestHandled(UringConnection& uringConnection, bool badRequest)
+{
+    RWebConnection& connection = uringConnection.connection;
+    RWebRequestParser& parser = connection.requestParser;
+
+    if (mAccessLog)
+    {
+        mAccessLog->beginRecord(connection);    // Before the request is removed from the buffer
+    }
+
+    if (badRequest)
+    {
+        // We do not know where the next request starts
+        connection.keepAlive = false;
+        connection.requestBuffer.clear();
+    }
+    else
+    {
+        connection.requestBuffer.erase(0, parser.consumedBytes());
+    }
+    parser.reset();
+
+    connection.state = RWebConnection::cs_SendingResponse;
+    connection.bytesSentZeroCopy = 0;
+    connection.bytesSentCopied = 0;
+    set_socket_cork(connection.fd, mSocketOptions, true);
+    applyResponsePriority(connection);
+    sendMore(uringConnection);
+}
+
+// Called from worker thread
+void
+RWebUringLoop::postHandled(int fd)
+{
+    {
+        std::lock_guard<std::mutex> lock(mHandledMutex);
+        mHandled.push_back(fd);
+    }
+
+    uint64_t wake = 1;
+    (void)write(mWakeFD, &wake, sizeof(wake));
+}
+
+void
+RWebUringLoop::onHandled()
+{
+    std::vector<int> handled;
+    {
+        std::lock_guard<std::mutex> lock(mHandledMutex);
+        handled.swap(mHandled);
+    }
+
+    for (int fd : handled)
+    {
+        auto it = mConnections.find(fd);
+        if (it == mConnections.end()) { continue; }
+        UringConnection& uringConnection = *it->second;
+
+        requestHandled(uringConnection, false);
+
+        if (uringConnection.recvDelayed)
+        {
+            uringConnection.recvDelayed = false;
+            onRecv(uringConnection, uringConnection.delayedRecvResult);
+        }
+        else if (uringConnection.connection.state != RWebConnection::cs_Handling)
+        {
+            queueRecv(uringConnection);
+        }
+
+        if (uringConnection.connection.state == RWebConnection::cs_Closed)
+        {
+            closeConnection(uringConnection);
+        }
+    }
+}
+
+// Queue the next send or file read of the response
+void
+RWebUringLoop::sendMore(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+
+    while (connection.state == RWebConnection::cs_SendingResponse && !uringConnection.sendPending)
+    {
+        bool bodyFollows = connection.bodyRemaining > 0 || !connection.bodyParts.empty();
+
+        if (connection.responseHeadSent < connection.responseHead.size())
+        {
+            bool more = bodyFollows || connection.bodyDataSent < connection.bodyData.size();
+            queueSend(uringConnection, connection.responseHead.data() + connection.responseHeadSent,
+                      connection.responseHead.size() - connection.responseHeadSent, more);
+            return;
+        }
+
+        if (connection.bodyDataSent < connection.bodyData.size())
+        {
+            std::size_t remaining = connection.bodyData.size() - connection.bodyDataSent;
+            std::size_t size = pacing_allowance(connection, mTotalPacer, remaining);
+            if (size == 0)
+            {
+                waitForPacer(uringConnection);
+                return;
+            }
+            queueSend(uringConnection, connection.bodyData.data() + connection.bodyDataSent,
+                      size, bodyFollows);
+            return;
+        }
+
+        if (connection.bodyRemaining > 0 && connection.bodyFD >= 0)
+        {
+            queueReadBody(uringConnection);
+            return;
+        }
+
+        if (!connection.bodyParts.empty())
+        {
+            connection.nextBodyPart();
+            continue;
+        }
+
+        finishResponse(uringConnection);
+        return;
+    }
+}
+
+void
+RWebUringLoop::finishResponse(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+
+    RLOG(rlog::Verbose, connection.connectionId << ": SEND Finished. Copied bytes: " << connection.bytesSentCopied);
+    if (mAccessLog)
+    {
+        mAccessLog->finishRecord(connection);
+    }
+    connection.closeBody();
+    set_socket_cork(connection.fd, mSocketOptions, false);
+    connection.lastActivity = std::chrono::steady_clock::now();
+    mRequestLatency.record(connection.lastActivity - connection.requestStart);
+
+    if (connection.keepAlive)
+    {
+        connection.responseHead.clear();
+        connection.responseHeadSent = 0;
+        connection.state = RWebConnection::cs_ReadingRequest;
+
+        // Next request may already be in the buffer
+        startNextRequest(uringConnection);
+        return;
+    }
+
+    // Signal end of data, and let the client close the connection.
+    // Remaining client data is read and dropped until then.
+    shutdown(connection.fd, SHUT_WR);
+    connection.state = RWebConnection::cs_Draining;
+    queueRecv(uringConnection);
+}
+
+// Queued operations still use the socket and the buffers, so the
+// connection is released when the last operation has completed.
+void
+RWebUringLoop::closeConnection(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+    connection.state = RWebConnection::cs_Closed;
+    if (uringConnection.closing) { return; }
+
+    RLOG(rlog::Verbose, "Close connection #" << connection.connectionId);
+    uringConnection.closing = true;
+    shutdown(connection.fd, SHUT_RDWR);     // Ends pending recv and send
+    if (uringConnection.readBodyPending)
+    {
+        queueCancelReadBody(uringConnection);
+    }
+    mClosedConnections.push_back(connection.fd);
+}
+
+void
+RWebUringLoop::releaseClosedConnections()
+{
+    std::vector<int> stillPending;
+
+    for (int fd : mClosedConnections)
+    {
+        auto it = mConnections.find(fd);
+        if (it == mConnections.end()) { continue; }
+
+        UringConnection& uringConnection = *it->second;
+        if (uringConnection.pendingOperations > 0)
+        {
+            stillPending.push_back(fd);
+            continue;
+        }
+
+        RWebConnection& connection = uringConnection.connection;
+        connection.closeBody();
+        if (mClientLimiter && !connection.clientAddress.empty())
+        {
+            mClientLimiter->release(connection.clientAddress);
+        }
+        close(fd);
+        mConnections.erase(it);
+        mActiveConnections.add(-1);
+    }
+
+    mClosedConnections.swap(stillPending);
+}
+
+void
+RWebUringLoop::closeExpiredConnections()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto& item : mConnections)
+    {
+        UringConnection& uringConnection = *item.second;
+        RWebConnection& connection = uringConnection.connection;
+        if (connection.state == RWebConnection::cs_Handling || uringConnection.closing) { continue; }
+
+        std::chrono::seconds timeout = sIdleTimeout;
+        if (connection.state == RWebConnection::cs_Draining)
+        {
+            timeout = sDrainTimeout;
+        }
+        else if (connection.state == RWebConnection::cs_ReadingRequest
+                 && connection.requestBuffer.empty())
+        {
+            timeout = std::chrono::seconds(sKeepAliveTimeoutSeconds);
+        }
+        if (now - connection.lastActivity > timeout)
+        {
+            closeConnection(uringConnection);
+        }
+    }
+}
+
+void
+RWebUringLoop::waitForPacer(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+    if (connection.waitingForPacer) { return; }
+
+    connection.waitingForPacer = true;
+    mPacedConnections.push_back(connection.fd);
+}
+
+// One pace timer is queued at a time, for the first paced connection.
+// Called before each submit, so it also covers connections paced since
+void
+RWebUringLoop::queuePaceTimer()
+{
+    if (mPaceTimerQueued || mPacedConnections.empty()) { return; }
+
+    auto first = std::chrono::steady_clock::time_point::max();
+    for (int fd : mPacedConnections)
+    {
+        auto it = mConnections.find(fd);
+        if (it != mConnections.end()) { first = std::min(first, it->second->connection.pacedUntil); }
+    }
+    if (first == std::chrono::steady_clock::time_point::max()) { first = std::chrono::steady_clock::now(); }
+
+    struct io_uring_sqe* sqe = getSqe(op_PaceTimer, 0);
+    if (!sqe) { return; }
+
+    auto wait = std::max(first - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration::zero());
+    int64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count();
+    mPaceTimerSpec.seconds = nanoseconds / 1000000000LL;
+    mPaceTimerSpec.nanoseconds = nanoseconds % 1000000000LL;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&mPaceTimerSpec);
+    sqe->len = 1;
+    mPaceTimerQueued = true;
+}
+
+void
+RWebUringLoop::resumePacedConnections()
+{
+    auto now = std::chrono::steady_clock::now();
+    std::vector<int> paced;
+    paced.swap(mPacedConnections);
+
+    for (int fd : paced)
+    {
+        auto it = mConnections.find(fd);
+        if (it == mConnections.end()) { continue; }
+        UringConnection& uringConnection = *it->second;
+        RWebConnection& connection = uringConnection.connection;
+        if (!connection.waitingForPacer || uringConnection.closing) { continue; }
+
+        if (connection.pacedUntil > now)
+        {
+            mPacedConnections.push_back(fd);
+            continue;
+        }
+
+        connection.waitingForPacer = false;
+        sendMore(uringConnection);
+        if (connection.state == RWebConnection::cs_Closed)
+        {
+            closeConnection(uringConnection);
+        }
+    }
+}
+
+void
+RWebUringLoop::scheduleSend(UringConnection& uringConnection)
+{
+    RWebConnection& connection = uringConnection.connection;
+    if (connection.sendScheduled) { return; }
+
+    connection.sendScheduled = true;
+    mSendQueues[connection.priority].push_back(connection.fd);
+}
+
+void
+RWebUringLoop::sendScheduledConnections()
+{
+    for (auto& queue : mSendQueues)
+    {
+        std::vector<int> scheduled;
+        scheduled.swap(queue);
+
+        for (int fd : scheduled)
+        {
+            auto it = mConnections.find(fd);
+            if (it == mConnections.end()) { continue; }
+            UringConnection& uringConnection = *it->second;
+            RWebConnection& connection = uringConnection.connection;
+            if (!connection.sendScheduled || uringConnection.closing) { continue; }
+
+            connection.sendScheduled = false;
+            sendMore(uringConnection);
+            if (connection.state == RWebConnection::cs_Closed)
+            {
+                closeConnection(uringConnection);
+            }
+        }
+    }
+}
@@ -16,6 +16,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
 #include "rweb/RWebUtils.h"
 
 
@@ -97,7 +113,27 @@ ascii_to_lower(const std::string& str)
     return result;
 }
 
-std::vector<ExtensionMimeType> extensionMimeTypes = {
+static constexpr char
+ascii_to_lower(char x)
+{
+    return (x>='A' && x<='Z') ? x - ('A'-'a') : x;
+}
+
+bool
+equals_ignore_case(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size()) { return false; }
+
+    for (std::size_t i=0; i<a.size(); ++i)
+    {
+        if (ascii_to_lower(a[i]) != ascii_to_lower(b[i])) { return false; }
+    }
+
+    return true;
+}
+
+// Known file types. Extensions are lower case
+static constexpr ExtensionMimeType sMimeTypes[] = {
     {"aac",  "audio/mp4" },
     {"mp3",  "audio/mp3" },
     {"wav",  "audio/wav" },
@@ -123,20 +159,440 @@ std::vector<ExtensionMimeType> extensionMimeTypes = {
     {"html", "text/html" }
     };
 
+static constexpr std::size_t sMimeTypeCount = sizeof(sMimeTypes) / sizeof(sMimeTypes[0]);
+static constexpr std::size_t sMimeTableBits = 6;
+static constexpr std::size_t sMimeTableSize = 1 << sMimeTableBits;
+static constexpr std::size_t sMaxExtensionLength = 8;
+
+// FNV-1a of lower case extension, multiplied with an odd seed.
+// High bits of the product depend on all bits, so they are the slot.
+static constexpr std::size_t
+mime_table_slot(std::string_view extension, uint32_t seed)
+{
+    uint32_t hash = 2166136261u;
+    for (char x : extension)
+    {
+        hash = (hash ^ static_cast<unsigned char>(ascii_to_lower(x))) * 16777619u;
+    }
+
+    return static_cast<uint32_t>(hash * (2*seed + 1)) >> (32 - sMimeTableBits);
+}
+
+// Find seed where no two extensions use the same table slot
+static constexpr uint32_t
+find_perfect_hash_seed()
+{
+    for (uint32_t seed = 0; seed < 10000; ++seed)
+    {
+        bool used[sMimeTableSize] = {};
+        bool collision = false;
+        for (const ExtensionMimeType& emt : sMimeTypes)
+        {
+            std::size_t slot = mime_table_slot(emt.fileExtension, seed);
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) { return seed; }
+    }
+
+    return 0xffffffff;
+}
+
+static constexpr uint32_t sMimeHashSeed = find_perfect_hash_seed();
+static_assert(sMimeHashSeed != 0xffffffff, "No perfect hash for sMimeTypes. Increase sMimeTableSize");
+
+// Slot => index in sMimeTypes, or -1 if unused
+static constexpr std::array<int8_t, sMimeTableSize>
+build_mime_table()
+{
+    std::array<int8_t, sMimeTableSize> table = {};
+    for (std::size_t slot = 0; slot < sMimeTableSize; ++slot)
+    {
+        table[slot] = -1;
+    }
+    for (std::size_t i = 0; i < sMimeTypeCount; ++i)
+    {
+        table[mime_table_slot(sMimeTypes[i].fileExtension, sMimeHashSeed)] = i;
+    }
+
+    return table;
+}
+
+static constexpr std::array<int8_t, sMimeTableSize> sMimeTable = build_mime_table();
+
+
+// Mime types added with add_mime_type(). Lower case extension => mime type.
+// The map is never changed, add_mime_type() replaces it.
+// Strings are kept in sOverlayStrings until exit, so returned views stay valid.
+using MimeTypeOverlay = std::unordered_map<std::string, std::string_view>;
+static std::shared_ptr<const MimeTypeOverlay> sMimeTypeOverlay;
+static std::atomic<bool> sHasMimeTypeOverlay{false};    // atomic_load of shared_ptr takes a lock
+static std::mutex sOverlayMutex;
+static std::deque<std::string> sOverlayStrings;
+
+static std::string_view
+file_extension(std::string_view filename)
+{
+    std::size_t dot = filename.rfind('.');
+    if (dot == std::string_view::npos) { return std::string_view(); }
+
+    std::string_view extension = filename.substr(dot+1);
+    if (extension.find('/') != std::string_view::npos) { return std::string_view(); }   // Dot in a directory name
+
+    return extension;
+}
+
+std::string_view
+extension_to_mime_type(std::string_view filename)
+{
+    std::string_view extension = file_extension(filename);
+    if (extension.empty() || extension.size() > sMaxExtensionLength) { return std::string_view(); }
+
+    std::shared_ptr<const MimeTypeOverlay> overlay;
+    if (sHasMimeTypeOverlay)
+    {
+        overlay = std::atomic_load(&sMimeTypeOverlay);
+    }
+    if (overlay)
+    {
+        // Short string, so no allocation
+        std::string lowerExtension;
+        for (char x : extension) { lowerExtension.push_back(ascii_to_lower(x)); }
+
+        auto found = overlay->find(lowerExtension);
+        if (found != overlay->end()) { return found->second; }
+    }
+
+    int index = sMimeTable[mime_table_slot(extension, sMimeHashSeed)];
+    if (index < 0 || !equals_ignore_case(extension, sMimeTypes[index].fileExtension))
+    {
+        return std::string_view();
+    }
+
+    return sMimeTypes[index].mimeType;
+}
+
+bool
+add_mime_type(std::string_view extension, std::string_view mimeType)
+{
+    if (extension.empty() || extension.size() > sMaxExtensionLength) { return false; }
+
+    std::lock_guard<std::mutex> lock(sOverlayMutex);
+
+    std::string lowerExtension;
+    for (char x : extension) { lowerExtension.push_back(ascii_to_lower(x)); }
+    sOverlayStrings.emplace_back(mimeType);
+
+    std::shared_ptr<const MimeTypeOverlay> overlay = std::atomic_load(&sMimeTypeOverlay);
+    auto newOverlay = overlay ? std::make_shared<MimeTypeOverlay>(*overlay)
+                              : std::make_shared<MimeTypeOverlay>();
+    (*newOverlay)[lowerExtension] = sOverlayStrings.back();
+    std::atomic_store(&sMimeTypeOverlay, std::shared_ptr<const MimeTypeOverlay>(newOverlay));
+    sHasMimeTypeOverlay = true;
+
+    return true;
+}
+
+
+
+// Max number of ranges in one request. More than that is likely an attack
+static const std::size_t sMaxRanges = 16;
+
+static bool
+parse_offset(const std::string& str, off_t& result)
+{
+    if (str.size() == 0 || str.size() > 18) { return false; }   // Empty or too large
+
+    result = 0;
+    for (char x : str)
+    {
+        if (x<'0' || x>'9') { return false; }
+        result = result*10 + (x-'0');
+    }
+
+    return true;
+}
+
+RangeParseResult
+parse_range_header(const std::string& value, off_t fileSize, std::vector<ByteRange>& ranges)
+{
+    ranges.clear();
+
+    std::string compactValue;
+    for (char x : value)
+    {
+        if (x != ' ' && x != '\t') { compactValue.push_back(x); }
+    }
+
+    if (ascii_to_lower(compactValue.substr(0,6)) != "bytes=") { return RangeParseResult::NoRange; }
+
+    std::string rangeSet = compactValue.substr(6);
+    if (rangeSet.size() == 0) { return RangeParseResult::NoRange; }
+
+    std::vector<std::string> rangeSpecs = split(rangeSet, ',');
+    if (rangeSpecs.size() > sMaxRanges) { return RangeParseResult::NoRange; }
+
+    std::size_t validSpecs = 0;
+    for (const std::string& rangeSpec : rangeSpecs)
+    {
+        if (rangeSpec.size() == 0) { continue; }    // Empty list elements are allowed
+        ++validSpecs;
+
+        std::size_t dash = rangeSpec.find('-');
+        if (dash == std::string::npos) { return RangeParseResult::NoRange; }
+
+        off_t first, last;
+        if (dash == 0)  // Suffix range: last N bytes
+        {
+            off_t suffixLength;
+            if (!parse_offset(rangeSpec.substr(1), suffixLength)) { return RangeParseResult::NoRange; }
+            if (suffixLength == 0 || fileSize == 0) { continue; }
+
+            first = suffixLength < fileSize ? fileSize - suffixLength : 0;
+            last = fileSize - 1;
+        }
+        else
+        {
+            if (!parse_offset(rangeSpec.substr(0, dash), first)) { return RangeParseResult::NoRange; }
+
+            if (dash+1 == rangeSpec.size())     // Open ended: "500-"
+            {
+                last = fileSize - 1;
+            }
+            else
+            {
+                if (!parse_offset(rangeSpec.substr(dash+1), last)) { return RangeParseResult::NoRange; }
+                if (last < first) { return RangeParseResult::NoRange; }
+                if (last >= fileSize) { last = fileSize - 1; }
+            }
+
+            if (first >= fileSize) { continue; }    // Does not overlap file
+        }
+
+        ranges.push_back({first, last});
+    }
+
+    if (validSpecs == 0) { return RangeParseResult::NoRange; }
+    if (ranges.size() == 0) { return RangeParseResult::Unsatisfiable; }
+
+    // Overlapping and adjacent ranges are sent once, see RFC 7233 section 6.1.
+    // Otherwise "bytes=0-,0-,..." asks for the file many times in one response
+    std::sort(ranges.begin(), ranges.end(),
+              [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; });
+    std::size_t merged = 0;
+    for (std::size_t i=1; i<ranges.size(); ++i)
+    {
+        if (ranges[i].first <= ranges[merged].last + 1)
+        {
+            ranges[merged].last = std::max(ranges[merged].last, ranges[i].last);
+        }
+        else
+        {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    ranges.resize(merged + 1);
+
+    return RangeParseResult::Satisfiable;
+}
+
+
+std::string
+format_http_date(time_t time)
+{
+    struct tm utcTime;
+    gmtime_r(&time, &utcTime);
+
+    // strftime %a and %b depend on locale, HTTP always uses English names
+    static const char* sDays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char* sMonths[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             sDays[utcTime.tm_wday], utcTime.tm_mday, sMonths[utcTime.tm_mon],
+             utcTime.tm_year + 1900, utcTime.tm_hour, utcTime.tm_min, utcTime.tm_sec);
+    return buffer;
+}
+
+bool
+parse_http_date(std::string_view value, time_t& time)
+{
+    static const std::string_view sMonths = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (value.size() != 29 || value.substr(3, 2) != ", " || value.substr(25) != " GMT")
+    {
+        return false;
+    }
+
+    auto number = [&](std::size_t offset, std::size_t length, int& result)
+    {
+        result = 0;
+        for (std::size_t i=offset; i<offset+length; ++i)
+        {
+            if (value[i] < '0' || value[i] > '9') { return false; }
+            result = result * 10 + (value[i] - '0');
+        }
+        return true;
+    };
+
+    struct tm utcTime = {};
+    std::size_t month = sMonths.find(value.substr(8, 3));
+    if (month == std::string_view::npos || month % 3 != 0) { return false; }
+    utcTime.tm_mon = month / 3;
+
+    if (!number(5, 2, utcTime.tm_mday) || !number(12, 4, utcTime.tm_year)
+        || !number(17, 2, utcTime.tm_hour) || !number(20, 2, utcTime.tm_min)
+        || !number(23, 2, utcTime.tm_sec))
+    {
+        return false;
+    }
+    utcTime.tm_year -= 1900;
+
+    time = timegm(&utcTime);
+    return true;
+}
+
+bool
+etag_matches(std::string_view ifNoneMatch, std::string_view etag)
+{
+    std::size_t start = 0;
+    while (start < ifNoneMatch.size())
+    {
+        std::size_t end = ifNoneMatch.find(',', start);
+        if (end == std::string_view::npos) { end = ifNoneMatch.size(); }
+
+        std::string_view candidate = ifNoneMatch.substr(start, end - start);
+        while (!candidate.empty() && candidate.front() == ' ') { candidate.remove_prefix(1); }
+        while (!candidate.empty() && candidate.back() == ' ') { candidate.remove_suffix(1); }
+        if (candidate.substr(0, 2) == "W/") { candidate.remove_prefix(2); }
+
+        if (candidate == "*" || candidate == etag) { return true; }
+        start = end + 1;
+    }
+    return false;
+}
+
+
+static std::string_view trim_spaces(std::string_view value)
+{
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) { value.remove_prefix(1); }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) { value.remove_suffix(1); }
+    return value;
+}
+
+// Quality of a coding like "gzip;q=0.5". No q parameter is 1
+static double coding_quality(std::string_view parameters)
+{
+    std::size_t q = parameters.find("q=");
+    if (q == std::string_view::npos) { return 1.0; }
+    return strtod(std::string(parameters.substr(q + 2)).c_str(), nullptr);
+}
+
+bool
+accepts_gzip(std::string_view acceptEncoding)
+{
+    double wildcardQuality = 0.0;
+
+    while (!acceptEncoding.empty())
+    {
+        std::size_t comma = acceptEncoding.find(',');
+        std::string_view item = acceptEncoding.substr(0, comma);
+        std::size_t semicolon = item.find(';');
+        std::string_view coding = trim_spaces(item.substr(0, semicolon));
+        std::string_view parameters = (semicolon == std::string_view::npos) ? "" : item.substr(semicolon + 1);
+
+        if (equals_ignore_case(coding, "gzip") || equals_ignore_case(coding, "x-gzip"))
+        {
+            return coding_quality(parameters) > 0.0;
+        }
+        if (coding == "*")
+        {
+            wildcardQuality = coding_quality(parameters);
+        }
+
+        if (comma == std::string_view::npos) { break; }
+        acceptEncoding.remove_prefix(comma + 1);
+    }
+
+    return wildcardQuality > 0.0;
+}
+
+bool
+is_compressible_mime_type(std::string_view mimeType)
+{
+    auto endsWith = [&](std::string_view suffix)
+    {
+        return mimeType.size() >= suffix.size()
+               && mimeType.substr(mimeType.size() - suffix.size()) == suffix;
+    };
+
+    return mimeType.substr(0, 5) == "text/"
+           || endsWith("+xml") || endsWith("+json") || endsWith("/xml") || endsWith("/json")
+           || equals_ignore_case(mimeType, "application/x-mpegurl")
+           || equals_ignore_case(mimeType, "application/vnd.apple.mpegurl")
+           || mimeType == "application/javascript";
+}
+
+
+bool
+gzip_compress(std::string_view input, std::string& output)
+{
+    z_stream stream = {};
+
+    // 16 added to window bits gives gzip header instead of zlib header
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+
+    output.resize(deflateBound(&stream, input.size()));
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = input.size();
+    stream.next_out = (Bytef*)output.data();
+    stream.avail_out = output.size();
+
+    int ret = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    return ret == Z_STREAM_END;
+}
+
+
 std::string
-extension_to_mime_type(const std::string& filename)
+socket_address_to_string(const struct sockaddr_storage& address)
 {
-    std::string mimeType;
-    for (ExtensionMimeType& emt : extensionMimeTypes)
+    char buffer[INET6_ADDRSTRLEN] = "";
+
+    if (address.ss_family == AF_INET6)
     {
-        if (ends_with(ascii_to_lower(filename), emt.fileExtension))
+        const struct sockaddr_in6& address6 = reinterpret_cast<const struct sockaddr_in6&>(address);
+        if (IN6_IS_ADDR_V4MAPPED(&address6.sin6_addr))
         {
-            mimeType = emt.mimeType;
-            break;
+            // Last 4 bytes is the IPv4 address
+            inet_ntop(AF_INET, &address6.sin6_addr.s6_addr[12], buffer, sizeof(buffer));
+        }
+        else
+        {
+            inet_ntop(AF_INET6, &address6.sin6_addr, buffer, sizeof(buffer));
         }
     }
+    else if (address.ss_family == AF_INET)
+    {
+        const struct sockaddr_in& address4 = reinterpret_cast<const struct sockaddr_in&>(address);
+        inet_ntop(AF_INET, &address4.sin_addr, buffer, sizeof(buffer));
+    }
 
-    return mimeType;
+    return buffer;
 }
 
+bool
+pin_thread_to_cpu(std::thread& thread, int cpu)
+{
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
 
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet) == 0;
+}
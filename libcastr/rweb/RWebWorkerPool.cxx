@@ -0,0 +1,167 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "rlog/RLog.h"
+#include "rweb/RWebWorkerPool.h"
+
+
+RWebWorkerPool::RWebWorkerPool(int threadCount, std::size_t maxQueueSize)
+  : mThreadCount(threadCount),
+    mMaxQueueSize(maxQueueSize)
+{
+}
+
+RWebWorkerPool::~RWebWorkerPool()
+{
+    stop();
+}
+
+void
+RWebWorkerPool::start()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mRunning) { return; }
+
+    mRunning = true;
+    for (int i=0; i<mThreadCount; ++i)
+    {
+        mThreads.emplace_back(
+            [this](){
+                this->workerLoop();
+            }
+        );
+    }
+}
+
+void
+RWebWorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+        mQueue.clear();
+        mQueueDepth.set(0);
+    }
+    mCondition.notify_all();
+
+    for (std::thread& thread : mThreads)
+    {
+        thread.join();
+    }
+    mThreads.clear();
+}
+
+bool
+RWebWorkerPool::submit(Job job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mRunning || mQueue.size() >= mMaxQueueSize)
+        {
+            ++mStats.jobsRejected;
+            mRejected.add();
+            return false;
+        }
+
+        mQueue.push_back({job, std::chrono::steady_clock::now()});
+        mStats.maxQueueDepth = std::max(mStats.maxQueueDepth, mQueue.size());
+        mQueueDepth.set(mQueue.size());
+    }
+    mCondition.notify_one();
+
+    return true;
+}
+
+RWebWorkerPoolStats
+RWebWorkerPool::stats()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    RWebWorkerPoolStats result = mStats;
+    result.queueDepth = mQueue.size();
+    if (mStats.jobsExecuted > 0)
+    {
+        result.averageWaitMs = mTotalWaitMs / mStats.jobsExecuted;
+    }
+
+    return result;
+}
+
+void
+RWebWorkerPool::workerLoop()
+{
+    while (true)
+    {
+        QueuedJob queuedJob;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this](){ return !mRunning || !mQueue.empty(); });
+            if (!mRunning) { return; }
+
+            queuedJob = std::move(mQueue.front());
+            mQueue.pop_front();
+            mQueueDepth.set(mQueue.size());
+
+            auto queueTime = std::chrono::steady_clock::now() - queuedJob.queueTime;
+            mQueueWait.record(queueTime);
+            std::chrono::duration<double, std::milli> wait = queueTime;
+            ++mStats.jobsExecuted;
+            mStats.lastWaitMs = wait.count();
+            mStats.maxWaitMs = std::max(mStats.maxWaitMs, wait.count());
+            mTotalWaitMs += wait.count();
+        }
+
+        queuedJob.job();
+    }
+}
+
+
+RWebClientLimiter::RWebClientLimiter(int maxConnectionsPerClient)
+  : mMaxConnectionsPerClient(maxConnectionsPerClient)
+{
+}
+
+bool
+RWebClientLimiter::acquire(const std::string& clientAddress)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    int& count = mConnectionCount[clientAddress];
+    if (mMaxConnectionsPerClient > 0 && count >= mMaxConnectionsPerClient)
+    {
+        RLOG(rlog::Verbose, "Client " << clientAddress << " has too many connections: " << count);
+        return false;
+    }
+    ++count;
+
+    return true;
+}
+
+void
+RWebClientLimiter::release(const std::string& clientAddress)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mConnectionCount.find(clientAddress);
+    if (it == mConnectionCount.end()) { return; }
+
+    if (--it->second <= 0)
+    {
+        mConnectionCount.erase(it);
+    }
+}
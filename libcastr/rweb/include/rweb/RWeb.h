@@ -2,6 +2,21 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include "rweb/RWebAccessLog.h"
+#include "rweb/RWebBlockCache.h"
+#include "rweb/RWebBodyProducer.h"
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebFileCache.h"
+#include "rweb/RWebMp4Index.h"
+#include "rweb/RWebPacing.h"
+#include "rweb/RWebSocketOptions.h"
+#include "rweb/RWebTailFollower.h"
+#include "rweb/RWebWorkerPool.h"
+
+class RWebLoop;
 
 
 struct PathFilterItem
@@ -19,8 +34,89 @@ public:
     bool start();
     void stop();
 
+    // May be called while the server is running
     void setFilter(const std::vector<PathFilterItem>& filter );
 
+    // Start reading the first parts a player needs of the file at urlPath,
+    // like the start and the MP4 index, before it is requested. Use when
+    // the next media item is known. May be called from any thread
+    void prefetch(const std::string& urlPath);
+
+    // Serve the output of producer at urlPath, like a transcoder writing
+    // fragmented MP4 or MPEG-TS. Each request gets a new body from the
+    // producer, streamed while it is made. The mime type is taken from the
+    // extension of urlPath. Must be called before start()
+    void addBodyProducer(const std::string& urlPath, RWebBodyProducer producer);
+
+    // Request handlers run in a pool of threadCount threads.
+    // Requests are rejected with 503 when maxQueueSize requests wait.
+    // threadCount 0 runs handlers in the event loop thread.
+    // Must be called before start()
+    void setWorkerPool(int threadCount, std::size_t maxQueueSize);
+
+    // Max simultaneous connections from one client address. 0 is unlimited.
+    // Must be called before start()
+    void setMaxConnectionsPerClient(int maxConnections);
+
+    RWebWorkerPoolStats workerPoolStats();
+
+    // Number of listen sockets. Each has its own loop thread on its own cpu,
+    // and the kernel spreads connections over them with SO_REUSEPORT.
+    // 0 is one per cpu. Default 1. Must be called before start()
+    void setListenerCount(int count);
+
+    // TCP tuning. Must be called before start()
+    void setSocketOptions(const RWebSocketOptions& options);
+
+    // Max body bytes per second of each connection, and of all connections
+    // together. 0 is unlimited, the default.
+    // A few times the media bitrate lets the player buffer ahead, without
+    // one transfer filling the link and delaying cast control and seeks.
+    // Must be called before start()
+    void setPacing(uint64_t connectionBytesPerSecond, uint64_t totalBytesPerSecond);
+
+    enum IoBackend
+    {
+        io_Epoll,   // Readiness events, sendfile from page cache
+        io_Uring    // Queued completions. File reads never block the loop
+    };
+
+    // io_Uring falls back to io_Epoll if the kernel does not support it.
+    // Must be called before start()
+    void setIoBackend(IoBackend backend);
+
+    // Number of open files with pre-rendered headers kept for repeated
+    // requests. 0 disables the cache. Must be called before start()
+    void setFileCacheSize(std::size_t maxEntries);
+
+    // Bytes of hot file blocks kept in memory, like the head and tail of
+    // media files and recently seeked ranges. 0 disables the block cache.
+    // Must be called before start()
+    void setBlockCacheSize(std::size_t maxBytes);
+
+    // Files in the root dir that are still being written, like live
+    // segments, are sent while they grow until the writer closes them,
+    // instead of the part written so far. Range requests get the part
+    // written so far. Also holds LL-HLS blocking playlist reloads of
+    // playlists in the root dir until they have the asked part.
+    // Default off. Must be called before start()
+    void setTailFollow(bool enabled);
+
+    // MP4 files are also served as HLS with fragmented MP4 segments made
+    // from their sample tables, as "<file>.mp4.m3u8". Players can seek in
+    // them without the whole file index, and nothing is converted.
+    // Default off. Must be called before start()
+    void setMp4Hls(bool enabled);
+
+    // MP4 files with the moov box after the media data are sent with moov
+    // first, so players start without reading the end of the file. The
+    // file is not changed. Default off. Must be called before start()
+    void setMp4Faststart(bool enabled);
+
+    // Path where the process metrics are served in Prometheus text format,
+    // like "/metrics". Default off. Must be called before start()
+    void setMetricsPath(const std::string& path);
+
     enum ServerState
     {
         ss_Init,
@@ -31,17 +127,67 @@ public:
 
 private:
 
-    void serverLoop();
-    void handleRequest(int fd, int connectionId);
+    struct ProducedBody
+    {
+        RWebBodyProducer producer;
+        std::string mimeType;
+        RWebPriority priority = pr_MediaSegment;
+    };
+
+    void handleRequest(RWebConnection& connection);
+    void createResponse(RWebConnection& connection);
+    std::shared_ptr<RWebCachedFile> openFile(const std::string& fileName, RWebConnection& connection);
+    void produceResponse(const ProducedBody& body, RWebConnection& connection);
+    bool growingResponse(const std::string& fileName, RWebConnection& connection);
+    void mp4HlsResponse(const std::string& mp4Path, Mp4HlsResource resource, std::size_t segmentIndex,
+                        RWebConnection& connection);
     std::string getInternalPath(const std::string& publicPath);
+    int createListenSocket(bool reusePort);
 
     std::string mRootDir;
     int mPort;
     ServerState mServerState = ss_Init;
-    int mListenFD = 0;
+    int mListenerCount = 1;
+    RWebSocketOptions mSocketOptions;
+    uint64_t mConnectionPacingRate = 0;
+    uint64_t mTotalPacingRate = 0;
+    std::unique_ptr<RWebTokenBucket> mTotalPacer;
+    std::vector<int> mListenFDs;
+    std::vector<std::unique_ptr<RWebLoop>> mEventLoops;
+
+    int mWorkerThreads = 4;
+    std::size_t mMaxQueuedRequests = 64;
+    int mMaxConnectionsPerClient = 32;
+    std::unique_ptr<RWebWorkerPool> mWorkerPool;
+    std::unique_ptr<RWebClientLimiter> mClientLimiter;
+
+    IoBackend mIoBackend = io_Epoll;
+
+    std::string mMetricsPath;
+    std::unique_ptr<RWebAccessLog> mAccessLog;
+
+    std::size_t mFileCacheSize = 256;
+    std::unique_ptr<RWebFileCache> mFileCache;
+
+    std::size_t mBlockCacheSize = 64*1024*1024;
+    std::unique_ptr<RWebBlockCache> mBlockCache;
+
+    bool mMp4Faststart = false;
+    bool mMp4Hls = false;
+    std::unique_ptr<RWebMp4IndexCache> mMp4IndexCache;
+
+    bool mTailFollow = false;
+    std::unique_ptr<RWebTailFollower> mTailFollower;
+
+    // Normalized public path => producer of the body
+    std::unordered_map<std::string, ProducedBody> mBodyProducers;
+
+    // Normalized public path => internal path, with root dir added to relative paths
+    using FilterIndex = std::unordered_map<std::string, std::string>;
 
     // When filter is enabled, only serve files in the filter.
-    // Otherwise serve all files below root dir
-    std::vector<PathFilterItem> mFilter;
+    // Otherwise serve all files below root dir.
+    // The index is never changed. setFilter() replaces it with atomic_store()
+    std::shared_ptr<const FilterIndex> mFilterIndex;
 };
 
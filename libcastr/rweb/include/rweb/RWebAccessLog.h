@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "utils/Metrics.h"
+
+struct RWebConnection;
+
+
+// One line of the access log. Fixed size, so it can be copied into the
+// ring without allocating memory.
+struct RWebAccessRecord
+{
+    std::chrono::system_clock::time_point finishTime;
+    uint32_t durationMicroseconds = 0;
+    int status = 0;                 // 0 while no response is being logged
+    int connectionId = 0;
+    uint64_t bytesSent = 0;         // Headers included
+    char clientAddress[46] = {};    // Fits an IPv6 address
+    char method[8] = {};
+    char range[48] = {};            // Range header as sent by client
+    char path[256] = {};            // Truncated if longer
+};
+
+// Access log written by a background thread. The loops put one record per
+// response in a lock-free ring buffer, so they never wait for the log
+// stream. When the ring is full, records are dropped and counted.
+class RWebAccessLog
+{
+public:
+    RWebAccessLog(std::size_t capacity);    // Rounded up to a power of 2
+    ~RWebAccessLog();
+
+    void start();
+    void stop();    // Writes remaining records before it returns
+
+    // Request part of the record. Call before the request buffer is reused.
+    // Status is taken from connection.responseHead.
+    void beginRecord(RWebConnection& connection);
+
+    // Adds bytes and duration and queues the record. Never blocks
+    void finishRecord(RWebConnection& connection);
+
+private:
+
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        RWebAccessRecord record;
+    };
+
+    bool push(const RWebAccessRecord& record);
+    bool pop(RWebAccessRecord& record);
+    void writerLoop();
+
+    std::unique_ptr<Slot[]> mSlots;
+    uint64_t mMask;
+
+    alignas(64) std::atomic<uint64_t> mEnqueuePosition{0};
+    alignas(64) uint64_t mDequeuePosition = 0;  // Only used by writer thread
+
+    std::atomic<uint64_t> mDropped{0};
+    metrics::Counter& mDroppedMetric = metrics::Registry::global().counter(
+        "rweb_access_log_dropped_total", "Access log records dropped because the ring was full");
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebFileCache.h"
+#include "utils/Metrics.h"
+
+
+// Memory bounded LRU cache of file blocks that many requests read.
+// Players read the head of an MP4, jump to the moov box at the end and
+// come back, and several devices often play the same file. Blocks in
+// the head and tail of files, and in short ranges like seeks and
+// segments, are read from disk once and then served from memory.
+// Long transfers keep using sendfile, so they do not push out the hot
+// blocks. Used from all worker threads.
+class RWebBlockCache
+{
+public:
+    static constexpr off_t sBlockSize = 64*1024;
+
+    RWebBlockCache(std::size_t maxBytes);
+
+    // Append body parts that send length bytes from offset of the file.
+    // Hot blocks become parts that share the cached memory, the rest
+    // stays file ranges.
+    void appendRange(const RWebCachedFile& file, off_t offset, off_t length,
+                     std::deque<RWebBodyPart>& parts);
+
+    void clear();
+
+private:
+
+    // Read by the first request that needs it. Others wait for that read
+    struct Block
+    {
+        std::string key;
+        std::size_t size = 0;
+        std::once_flag readOnce;
+        std::string data;   // Empty if the read failed
+    };
+    using BlockPtr = std::shared_ptr<Block>;
+    using LruList = std::list<BlockPtr>;
+
+    BlockPtr get(const RWebCachedFile& file, off_t blockIndex);
+    void remove(const BlockPtr& block);
+    void erase(LruList::iterator it);
+
+    std::size_t mMaxBytes;
+    std::size_t mBytes = 0;
+
+    std::mutex mMutex;
+    LruList mLru;   // Most recently used first
+    std::unordered_map<std::string, LruList::iterator> mEntries;
+
+    metrics::Counter& mHits = metrics::Registry::global().counter(
+        "rweb_block_cache_hits_total", "File blocks served from the block cache");
+    metrics::Counter& mMisses = metrics::Registry::global().counter(
+        "rweb_block_cache_misses_total", "File blocks read from disk into the block cache");
+    metrics::Gauge& mCachedBytes = metrics::Registry::global().gauge(
+        "rweb_block_cache_bytes", "Size of the blocks in the block cache");
+};
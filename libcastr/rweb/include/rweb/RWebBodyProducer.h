@@ -0,0 +1,20 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+
+// Makes the body of a response with unknown length, like the output of an
+// encoder. Called once per request. Returns the read end of a pipe, or -1
+// on failure. Everything read until end of file is sent with chunked
+// transfer encoding. The pipe is closed when the response is done or the
+// client disconnects, so the writer gets SIGPIPE or EPIPE.
+using RWebBodyProducer = std::function<int()>;
+
+// Run command with /bin/sh. Returns the read end of a pipe with the
+// standard output of the command, or -1. Standard input is /dev/null.
+// The process is not waited for. It exits when the pipe is closed.
+int spawn_command_pipe(const std::string& command);
+
+// Producer that runs command for each request and streams its output
+RWebBodyProducer command_body_producer(const std::string& command);
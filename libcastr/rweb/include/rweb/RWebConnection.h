@@ -0,0 +1,128 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <sys/types.h>
+
+#include "rweb/RWebAccessLog.h"
+#include "rweb/RWebFileCache.h"
+#include "rweb/RWebPacing.h"
+#include "rweb/RWebPriority.h"
+#include "rweb/RWebRequestParser.h"
+
+
+// Part of a response body. Either a block of memory,
+// or a range of the connection bodyFD
+struct RWebBodyPart
+{
+    std::string data;
+    off_t fileOffset = 0;
+    off_t fileLength = 0;
+
+    // Memory owned by a cache. Sent instead of data when sharedOwner is set
+    std::shared_ptr<const void> sharedOwner;
+    std::string_view sharedData;
+};
+
+// State for one client connection owned by an RWebEventLoop.
+// The socket is non-blocking, so a response is usually sent
+// over several wake ups of the event loop.
+struct RWebConnection
+{
+    enum State
+    {
+        cs_ReadingRequest,
+        cs_Handling,        // Request handler runs in worker thread
+        cs_SendingResponse,
+        cs_Draining,        // Response sent. Waiting for client to close
+        cs_Closed
+    };
+
+    int fd = -1;
+    int connectionId = 0;
+    std::string clientAddress;
+    State state = cs_ReadingRequest;
+
+    // Data received from client. May contain several pipelined requests
+    std::string requestBuffer;
+
+    // Request being handled now. Views into requestBuffer are only
+    // valid while the request handler runs.
+    RWebRequestParser requestParser;
+    RWebRequest request;
+
+    // Keep connection open for more requests after this response
+    bool keepAlive = false;
+
+    // Set by the request handler. Lower priorities wait while higher are sent
+    RWebPriority priority = pr_Manifest;
+    RWebPriority socketPriority = pr_MediaSegment;     // Kernel default is best effort
+    bool sendScheduled = false;     // Waits in the send queue of its priority
+
+    // Response headers. Error responses also put the body here
+    std::string responseHead;
+    std::size_t responseHeadSent = 0;
+
+    // How the body is moved from bodyFD to the socket
+    enum BodySendMode
+    {
+        sm_SendFile,    // Zero-copy sendfile() from regular file
+        sm_Splice,      // Zero-copy splice() from pipe
+        sm_Copy         // read() into bodyBuffer and send(). Works for everything
+    };
+
+    // Response body read from file.
+    // bodyOffset and bodyRemaining is the file range being sent now.
+    // bodyParts are sent when the current range is finished.
+    int bodyFD = -1;
+    std::shared_ptr<const RWebCachedFile> bodyFile;    // Owns bodyFD if set
+    off_t bodyOffset = 0;
+    off_t bodyRemaining = 0;
+    std::deque<RWebBodyPart> bodyParts;
+    BodySendMode bodySendMode = sm_Copy;
+
+    // Body of unknown length from a pipe, sent until end of file.
+    // bodyRemaining stays at max until then. bodyChunked frames it
+    // with chunked transfer encoding. Without it, as for HTTP/1.0
+    // clients, the body ends when the connection is closed.
+    bool bodyUntilEnd = false;
+    bool bodyChunked = false;
+
+    // Per transfer statistics
+    off_t bytesSentZeroCopy = 0;
+    off_t bytesSentCopied = 0;
+
+    // Part of body in memory, not yet sent. Points into bodyBuffer,
+    // where file data is read, or into memory kept by bodyDataOwner
+    std::string_view bodyData;
+    std::size_t bodyDataSent = 0;
+    std::string bodyBuffer;
+    std::shared_ptr<const void> bodyDataOwner;
+
+    std::chrono::steady_clock::time_point lastActivity;
+    std::chrono::steady_clock::time_point requestStart;    // Request complete from client
+
+    // User space pacing of body sends. Only used when the
+    // kernel can not pace the socket with SO_MAX_PACING_RATE
+    std::unique_ptr<RWebTokenBucket> pacer;
+    std::chrono::steady_clock::time_point pacedUntil;
+    bool waitingForPacer = false;
+
+    RWebAccessRecord accessRecord;
+
+    void closeBody();
+
+    // Resize bodyBuffer for a read of at most maxSize bytes of the body.
+    // Returns where to read. maxSize is set to the size to read
+    char* prepareBodyRead(std::size_t& maxSize);
+
+    // The body read into bodyBuffer returned length bytes. 0 is end of file.
+    // Makes bodyData of them, framed as a chunk if the body is chunked
+    void bodyReadDone(std::size_t length);
+
+    // Continue with the first of bodyParts
+    void nextBodyPart();
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebLoop.h"
+
+class RWebWorkerPool;
+class RWebClientLimiter;
+
+
+// Edge triggered epoll reactor.
+// Accepts connections on a listen socket and drives all client sockets
+// from a single thread. Sockets are non-blocking and the state of every
+// connection is kept in an RWebConnection.
+// With a worker pool, request handlers run in the pool so slow file
+// system calls do not block the loop. A full pool queue gives 503.
+class RWebEventLoop : public RWebLoop
+{
+public:
+    RWebEventLoop(int listenFD, RequestHandler requestHandler,
+                  RWebWorkerPool* workerPool = nullptr,
+                  RWebClientLimiter* clientLimiter = nullptr);
+    ~RWebEventLoop();
+
+    bool start() override;
+    void stop() override;
+
+private:
+
+    void loop();
+    void acceptConnections();
+    void onReadable(RWebConnection& connection);
+    void onWritable(RWebConnection& connection);
+    bool startNextRequest(RWebConnection& connection);
+    void requestHandled(RWebConnection& connection, bool badRequest);
+    void postHandled(int fd);
+    void onHandled();
+    void startResponse(RWebConnection& connection);
+    void closeBody(RWebConnection& connection);
+    void finishResponse(RWebConnection& connection);
+    void closeConnection(int fd);
+    void closeExpiredConnections();
+    void waitForPacer(RWebConnection& connection);
+    void scheduleSend(RWebConnection& connection);
+    void sendScheduledConnections();
+    void resumePacedConnections();
+    int waitTimeoutMs();
+
+    int mListenFD;
+    int mEpollFD = -1;
+    int mWakeFD = -1;   // eventfd used to wake up the loop on stop()
+    RequestHandler mRequestHandler;
+    RWebWorkerPool* mWorkerPool;
+    RWebClientLimiter* mClientLimiter;
+
+    // Connections where the worker has finished the request handler
+    std::mutex mHandledMutex;
+    std::vector<int> mHandled;
+
+    std::unordered_map<int, std::unique_ptr<RWebConnection>> mConnections;
+    std::unordered_map<int, int> mPipeBodies;   // Body pipe fd => connection fd
+    int mNextConnectionId = 0;
+    std::chrono::steady_clock::time_point mLastTimeoutCheck;
+    std::vector<int> mPacedConnections;     // Waiting until their pacedUntil
+
+    // Writable connections by priority. Served in priority order after
+    // the events of each wake up.
+    std::array<std::vector<int>, pr_Count> mSendQueues;
+
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+};
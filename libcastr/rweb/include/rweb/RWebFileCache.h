@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+#include "rweb/RWebPriority.h"
+
+class RWebMp4Faststart;
+
+// An open file that can be served to many connections at the same time.
+// Body data is sent with explicit offsets (sendfile/pread), so the
+// shared fd position does not matter. The fd is closed when the last
+// user releases the entry, so eviction never closes a file being sent.
+struct RWebCachedFile
+{
+    ~RWebCachedFile();
+
+    std::string publicPath;
+    std::string internalPath;
+    int fd = -1;
+    off_t size = 0;
+    time_t mtime = 0;
+    long mtimeNanoseconds = 0;  // Live playlists may be rewritten many times per second
+    ino_t inode = 0;
+    std::string mimeType;
+    RWebPriority priority = pr_WholeFile;
+
+    // Validators for conditional requests
+    std::string etag;           // Quoted, as in the ETag header
+    std::string lastModified;   // HTTP date
+
+    // MP4 file with moov after the media data, sent with moov first.
+    // nullptr if the file is sent as it is
+    std::shared_ptr<const RWebMp4Faststart> faststart;
+
+    // Complete head for a plain 200 response without Range or Origin
+    std::string responseHeadKeepAlive;
+    std::string responseHeadClose;
+
+    // Text files are sent gzip compressed to clients that accept it. The body
+    // is made on first use, from "<file>.gz" if that is up to date, otherwise
+    // compressed here. A changed file gets a new entry, so each version of
+    // a playlist is compressed once.
+    bool compressible = false;
+    std::string gzipEtag;
+    mutable std::once_flag gzipOnce;
+    mutable std::string gzipBody;   // Empty if not available
+
+    int watchDescriptor = -1;   // inotify watch, or -1 if mtime is polled
+    std::chrono::steady_clock::time_point lastValidated;
+};
+
+// LRU cache of open files and pre-rendered response headers, keyed by
+// public path. Entries are dropped when inotify reports a change of the
+// file. Without inotify the file is checked with stat() at most once
+// every sRevalidateInterval. Used from all worker threads.
+class RWebFileCache
+{
+public:
+    using FilePtr = std::shared_ptr<const RWebCachedFile>;
+
+    RWebFileCache(std::size_t maxEntries);
+    ~RWebFileCache();
+
+    // Returns cached file, or nullptr if not cached or changed on disk
+    FilePtr get(const std::string& publicPath);
+
+    // Takes ownership of file.fd. Evicts least recently used entry when full.
+    // Not cached if the file has changed since it was opened
+    void put(std::shared_ptr<RWebCachedFile> file);
+
+    void clear();
+
+private:
+
+    using LruList = std::list<std::shared_ptr<RWebCachedFile>>;
+
+    void readChangeEvents();
+    bool isUnchanged(RWebCachedFile& file);
+    void erase(LruList::iterator it);
+
+    std::size_t mMaxEntries;
+    int mInotifyFD = -1;
+
+    std::mutex mMutex;
+    LruList mLru;   // Most recently used first
+    std::unordered_map<std::string, LruList::iterator> mEntries;
+    std::unordered_multimap<int, LruList::iterator> mWatches;   // Same file may have many public paths
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include "rweb/RWebAccessLog.h"
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebPacing.h"
+#include "rweb/RWebPriority.h"
+#include "rweb/RWebSocketOptions.h"
+#include "utils/Metrics.h"
+
+
+// Common interface of the loops that drive RWeb client connections.
+// RWebEventLoop uses epoll, RWebUringLoop uses io_uring.
+class RWebLoop
+{
+public:
+    // Called when connection.request has been parsed. Check request.badRequest.
+    // Must fill in the response part of the connection, and keepAlive.
+    using RequestHandler = std::function<void(RWebConnection& connection)>;
+
+    // Idle keep-alive connections are closed after this time
+    static constexpr int sKeepAliveTimeoutSeconds = 15;
+
+    virtual ~RWebLoop() {}
+
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+
+    // Run the loop thread on this cpu only. Must be called before start()
+    void setCpu(int cpu) { mCpu = cpu; }
+
+    // Log every response here. nullptr disables. Must be called before start()
+    void setAccessLog(RWebAccessLog* accessLog) { mAccessLog = accessLog; }
+
+    // Options set on each client connection. Must be called before start()
+    void setSocketOptions(const RWebSocketOptions& options) { mSocketOptions = options; }
+
+    // Max bytes per second sent on each connection. totalPacer limits the sum
+    // of all connections and may be shared by several loops. 0 and nullptr
+    // are unlimited. Must be called before start()
+    void setPacing(uint64_t connectionBytesPerSecond, RWebTokenBucket* totalPacer)
+    {
+        mConnectionPacingRate = connectionBytesPerSecond;
+        mTotalPacer = totalPacer;
+    }
+
+protected:
+
+    int mCpu = -1;  // -1 is any cpu
+    RWebAccessLog* mAccessLog = nullptr;
+    RWebSocketOptions mSocketOptions;
+    uint64_t mConnectionPacingRate = 0;
+    RWebTokenBucket* mTotalPacer = nullptr;
+
+    // Shared by all loops in the process
+    metrics::Gauge& mActiveConnections = metrics::Registry::global().gauge(
+        "rweb_active_connections", "Open client connections");
+    metrics::Counter& mBytesSent = metrics::Registry::global().counter(
+        "rweb_sent_bytes_total", "Response bytes sent, headers included");
+    metrics::Histogram& mRequestLatency = metrics::Registry::global().histogram(
+        "rweb_request_duration_seconds", "Time from request received until the whole response is sent");
+
+    // Clients that make no progress in this time are disconnected
+    static constexpr std::chrono::seconds sIdleTimeout{30};
+
+    // Time we allow the client to read the last data after we have sent
+    // everything. Closing while the client still sends data could make
+    // the kernel reset the connection and drop the end of the response.
+    static constexpr std::chrono::seconds sDrainTimeout{1};
+
+    // Max data we buffer from a client. Requests are small, so more than
+    // this while we send a response is not a normal pipelining client.
+    static constexpr std::size_t sMaxRequestBufferSize = 64*1024;
+
+    // Start pacing of a new connection. The kernel paces the socket if it
+    // can, otherwise the connection gets its own token bucket.
+    void startPacing(RWebConnection& connection)
+    {
+        if (mConnectionPacingRate == 0) { return; }
+        if (set_socket_pacing_rate(connection.fd, mConnectionPacingRate)) { return; }
+
+        connection.pacer = std::make_unique<RWebTokenBucket>(mConnectionPacingRate);
+    }
+
+    // Mark the socket with the priority of a new response
+    void applyResponsePriority(RWebConnection& connection)
+    {
+        if (connection.priority == connection.socketPriority) { return; }
+
+        set_socket_priority(connection.fd, connection.priority);
+        connection.socketPriority = connection.priority;
+    }
+
+    static inline const std::string sServiceUnavailableMessage = "HTTP/1.1 503 Service Unavailable\n"
+                                                                 "Retry-After: 1\n"
+                                                                 "Content-Length: 0\n"
+                                                                 "Connection: close\n"
+                                                                 "\n";
+};
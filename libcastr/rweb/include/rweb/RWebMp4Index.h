@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebFileCache.h"
+
+
+// Find the moov box of an MP4 file from the top level box headers.
+// Returns false for other files
+bool find_mp4_index(int fd, off_t fileSize, off_t& indexOffset, off_t& indexLength);
+
+// Parts of the HLS presentation served for "<file>.mp4"
+enum Mp4HlsResource
+{
+    mh_Playlist,        // "<file>.mp4.m3u8"
+    mh_InitSegment,     // "<file>.mp4.init.mp4"
+    mh_MediaSegment     // "<file>.mp4.<index>.m4s"
+};
+
+// Split a url path of the HLS presentation into the path of the MP4
+// file and the resource. Returns false for other paths
+bool parse_mp4_hls_path(const std::string& path, std::string& mp4Path,
+                        Mp4HlsResource& resource, std::size_t& segmentIndex);
+
+// Sample tables of a progressive MP4 file, read from its moov box.
+// Used to serve the file as an HLS presentation with fragmented MP4
+// segments, so players can seek in it without converting the file.
+// Each segment starts at a key frame. It is a moof box made here from
+// the sample tables, followed by the samples sent from the original file.
+class RWebMp4Index
+{
+public:
+    // Returns nullptr if the file is not a progressive MP4 with video or audio
+    static std::shared_ptr<const RWebMp4Index> create(int fd, off_t fileSize);
+
+    std::size_t segmentCount() const { return mSegments.size(); }
+
+    // Media playlist. mp4Name is the url encoded name of the file,
+    // which the segment names are made from
+    std::string playlist(const std::string& mp4Name) const;
+
+    // ftyp and moov with the codec setup of the tracks, without samples
+    const std::string& initSegment() const { return mInitSegment; }
+
+    // Append the body of a media segment, as memory and file range parts.
+    // Returns the length of the body
+    off_t appendMediaSegment(std::size_t segmentIndex, std::deque<RWebBodyPart>& parts) const;
+
+    // Sample tables of a track, one entry per sample
+    struct Sample
+    {
+        uint64_t offset = 0;
+        uint32_t size = 0;
+        uint32_t duration = 0;
+        int32_t compositionOffset = 0;
+        bool sync = true;
+    };
+
+    struct Track
+    {
+        uint32_t id = 0;
+        uint32_t timescale = 0;
+        std::string handler;    // "vide" or "soun"
+        std::vector<Sample> samples;
+    };
+
+private:
+
+    // Samples of one track in a segment
+    struct TrackRange
+    {
+        std::size_t first = 0;
+        std::size_t end = 0;
+        uint64_t decodeTime = 0;
+    };
+
+    struct Segment
+    {
+        double duration = 0;
+        std::vector<TrackRange> tracks;     // Same order as mTracks
+    };
+
+    bool parse(const std::string& moov, off_t fileSize);
+    void createSegments();
+
+    std::vector<Track> mTracks;     // Video first if there is video
+    std::vector<Segment> mSegments;
+    std::string mInitSegment;
+};
+
+// Layout of an MP4 file with its moov box moved in front of the media
+// data, and the chunk offsets in it changed to match. Players get the
+// index first and start without reading the end of the file. The moov
+// box is kept in memory, all other data is sent from the original file.
+// The layout has the same size as the file.
+class RWebMp4Faststart : public std::enable_shared_from_this<RWebMp4Faststart>
+{
+public:
+    // Returns nullptr if moov is already in front of the media data,
+    // or if the file is not a progressive MP4
+    static std::shared_ptr<const RWebMp4Faststart> create(int fd, off_t fileSize);
+
+    // Append body parts that send length bytes from offset of the layout
+    void appendRange(off_t offset, off_t length, std::deque<RWebBodyPart>& parts) const;
+
+private:
+
+    off_t mMediaOffset = 0;     // First mdat box, where moov is moved to
+    off_t mIndexOffset = 0;     // moov box in the file
+    std::string mIndex;         // moov box with changed chunk offsets
+};
+
+// Indexes of recently served MP4 files. Each version of a file is parsed
+// once, by the first request that needs it. Used from all worker threads.
+class RWebMp4IndexCache
+{
+public:
+    using IndexPtr = std::shared_ptr<const RWebMp4Index>;
+
+    RWebMp4IndexCache(std::size_t maxEntries);
+
+    // Returns nullptr if the file can not be served as HLS
+    IndexPtr get(const RWebCachedFile& file);
+
+private:
+
+    struct Entry
+    {
+        std::string key;
+        std::once_flag parseOnce;
+        IndexPtr index;
+    };
+    using EntryPtr = std::shared_ptr<Entry>;
+    using LruList = std::list<EntryPtr>;
+
+    std::size_t mMaxEntries;
+
+    std::mutex mMutex;
+    LruList mLru;   // Most recently used first
+    std::unordered_map<std::string, LruList::iterator> mEntries;
+};
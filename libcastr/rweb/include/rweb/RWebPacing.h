@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+struct RWebConnection;
+
+
+// Token bucket that limits a byte stream to bytesPerSecond.
+// A send may use all tokens in the bucket at once, so a fast start is
+// allowed up to the burst size, and the long term rate is still exact.
+// Thread safe, so one bucket can limit the sum of all loops.
+class RWebTokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    RWebTokenBucket(uint64_t bytesPerSecond);
+
+    // Bytes that may be sent now. 0 until enough tokens have
+    // collected for a send worth waking up for.
+    std::size_t available(Clock::time_point now);
+
+    void consume(std::size_t bytes);
+
+    // When available() is no longer 0
+    Clock::time_point readyTime(Clock::time_point now);
+
+private:
+    void refill(Clock::time_point now);
+
+    std::mutex mMutex;
+    double mRate;       // Bytes per second
+    double mBurst;      // Max tokens
+    double mMinSend;    // Fewer tokens than this are not worth a send
+    double mTokens;
+    Clock::time_point mLastRefill;
+};
+
+// Let the kernel pace the socket with SO_MAX_PACING_RATE.
+// Returns false if this kernel can not do it
+bool
+set_socket_pacing_rate(int socketFD, uint64_t bytesPerSecond);
+
+// Body bytes the connection may send now, at most maxBytes. Limited by
+// the user space pacer of the connection and by totalPacer if they are set.
+// Returns 0 and sets connection.pacedUntil when the send must wait.
+std::size_t
+pacing_allowance(RWebConnection& connection, RWebTokenBucket* totalPacer, std::size_t maxBytes);
+
+// Take body bytes that were sent from the pacers
+void
+pacing_consume(RWebConnection& connection, RWebTokenBucket* totalPacer, std::size_t bytes);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string_view>
+
+
+// Playlist position a client waits for with an LL-HLS blocking playlist
+// reload: "?_HLS_msn=<media sequence number>&_HLS_part=<part index>"
+struct HlsBlockingRequest
+{
+    long mediaSequence = -1;
+    long part = -1;     // -1 waits for the whole segment
+};
+
+// Returns false if the query has no _HLS_msn
+bool parse_hls_blocking_request(std::string_view query, HlsBlockingRequest& request);
+
+// True when the playlist has the segment, or the part of it, that the
+// request waits for. Also true when the playlist has ended
+bool hls_playlist_has(std::string_view playlist, const HlsBlockingRequest& request);
+
+// True when the request waits for a segment more than two after the last
+// one in the playlist. Such requests are answered with 400 right away
+bool hls_request_too_far(std::string_view playlist, const HlsBlockingRequest& request);
+
+// EXT-X-TARGETDURATION in seconds, or defaultSeconds if not set
+long hls_target_duration(std::string_view playlist, long defaultSeconds);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <sys/types.h>
+
+
+// Send order of responses. Live players poll manifests and stall when a
+// refresh is late, so they go ahead of segments and whole files.
+enum RWebPriority
+{
+    pr_Manifest,        // HLS and DASH playlists. Also error and server made responses
+    pr_InitSegment,     // Small files, like init segments and subtitles
+    pr_MediaSegment,
+    pr_WholeFile,       // Progressive download of a complete media file
+    pr_Count
+};
+
+// Class of a response from its mime type and the size of the whole file.
+// Ranges of a large file are still a whole file transfer.
+RWebPriority
+response_priority(std::string_view mimeType, off_t fileSize);
+
+// Body bytes a connection may send before the loop serves other
+// connections. Higher priorities are not limited.
+std::size_t
+send_budget(RWebPriority priority);
+
+// Mark packets of the socket, so the kernel queue and Wi-Fi access
+// categories also send higher priorities first
+void
+set_socket_priority(int socketFD, RWebPriority priority);
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+
+
+struct RWebHeader
+{
+    std::string_view name;
+    std::string_view value;
+};
+
+// A parsed HTTP request header.
+// Views point into the connection receive buffer and are only valid
+// until the buffer is changed. path points into pathStorage.
+struct RWebRequest
+{
+    static const std::size_t sMaxHeaders = 32;
+    static const std::size_t sMaxPathLength = 4096;
+
+    bool badRequest = false;
+
+    std::string_view raw;       // Request line and all headers
+    std::string_view method;
+    std::string_view target;    // Request target as sent by client
+    std::string_view query;     // Part of target after '?'
+    std::string_view path;      // Percent decoded and normalized. Always starts with '/'
+    int versionMajor = 1;
+    int versionMinor = 0;
+
+    std::array<RWebHeader, sMaxHeaders> headers;
+    std::size_t headerCount = 0;
+
+    // Returns value of header, or empty view. Header names are case insensitive
+    std::string_view header(std::string_view name) const;
+
+    // Case insensitive search for token in a comma separated header value
+    bool headerHasToken(std::string_view name, std::string_view token) const;
+
+    std::array<char, sMaxPathLength> pathStorage;
+};
+
+// Incremental HTTP/1.x request header parser.
+// Call parse() each time more data has been received. The search for
+// end of header continues where the previous call stopped, so a request
+// split over many TCP packets is only scanned once.
+// No memory is allocated while parsing.
+class RWebRequestParser
+{
+public:
+    enum Result
+    {
+        pr_Incomplete,  // Need more data
+        pr_Complete,    // request is filled in. consumedBytes() is header size
+        pr_Error        // Malformed or too large request
+    };
+
+    static const std::size_t sMaxHeaderSize = 8192;
+
+    Result parse(std::string_view buffer, RWebRequest& request);
+
+    // Bytes of the buffer used by the last complete request
+    std::size_t consumedBytes() const { return mConsumedBytes; }
+
+    // Prepare for next request in the buffer
+    void reset();
+
+private:
+    bool parseHeader(std::string_view header, RWebRequest& request);
+
+    std::size_t mScanOffset = 0;
+    std::size_t mConsumedBytes = 0;
+};
+
+// Percent decode path and resolve ".", ".." and empty segments.
+// Result is written to output, which must hold maxLength chars.
+// Returns length of result, or 0 if the path is invalid or
+// tries to go above the root.
+std::size_t normalize_path(std::string_view path, char* output, std::size_t maxLength);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+
+
+// TCP tuning of the listen socket and client connections.
+// The defaults leave everything to the kernel.
+struct RWebSocketOptions
+{
+    // Hold partial frames from the response head until the body
+    // follows. Headers are already sent with MSG_MORE, so this only
+    // matters for bodies sent in several parts, like byte ranges.
+    bool cork = false;
+
+    // Wake up for a new connection when the request has arrived, not at
+    // connect. Seconds the kernel waits for data. 0 is off
+    int deferAcceptSeconds = 0;
+
+    // Max pending TCP Fast Open requests. Returning clients then send the
+    // request in the SYN and save one round trip. 0 is off
+    int fastOpenQueueLength = 0;
+
+    // SO_SNDBUF of client connections in bytes. 0 keeps kernel autotuning
+    int sendBufferSize = 0;
+
+    // Like "bbr" or "cubic". Empty uses the system default
+    std::string congestionControl;
+};
+
+// Set options that belong on the listen socket. Accepted connections inherit
+// them. Failing options are logged, since the kernel may not support them.
+void
+apply_listen_socket_options(int listenFD, const RWebSocketOptions& options);
+
+// Set options of an accepted connection
+void
+apply_connection_socket_options(int socketFD, const RWebSocketOptions& options);
+
+// Start or end a corked response, if cork is set in options
+void
+set_socket_cork(int socketFD, const RWebSocketOptions& options, bool cork);
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <sys/types.h>
+
+#include "rweb/RWebPlaylist.h"
+
+
+// Follows files in a folder that are still being written, like the live
+// segments of an encoder. inotify tells which files are open for writing.
+// Encoders like ffmpeg's dash and hls muxers write each file as
+// "<name>.tmp" and rename it when complete. That file is followed as <name>.
+// A followed file is copied into a pipe as it grows, until the writer
+// closes it, and RWeb sends the pipe as a chunked body.
+// One thread does the copying for all followed files.
+// The same thread holds LL-HLS blocking playlist reloads until the
+// playlist has the part the client asks for.
+class RWebTailFollower
+{
+public:
+    RWebTailFollower(const std::string& folder);
+    ~RWebTailFollower();
+
+    // Returns false if inotify is not available
+    bool start();
+    void stop();
+
+    // Path of the file a writer has created or modified for internalPath,
+    // and not closed yet. Either internalPath or "<internalPath>.tmp".
+    // Empty if the file is not growing. Thread safe
+    std::string growingFile(const std::string& internalPath);
+
+    // Returns the read end of a pipe that gets the whole file, and then new
+    // data until the writer closes it. -1 on failure. fd is not used after
+    // the call returns. Thread safe
+    int follow(const std::string& internalPath, int fd);
+
+    // Returns the read end of a pipe that gets the playlist when it has the
+    // segment or part of position, or after 3 target durations. -1 on
+    // failure. Thread safe
+    int waitForPlaylist(const std::string& internalPath, const HlsBlockingRequest& position);
+
+private:
+
+    struct Follower
+    {
+        std::string path;   // Normalized
+        int fileFD = -1;
+        off_t offset = 0;
+        int pipeFD = -1;    // Write end
+        bool writerClosed = false;
+    };
+
+    struct PlaylistWaiter
+    {
+        std::string path;   // Normalized
+        HlsBlockingRequest position;
+        int pipeFD = -1;    // Write end
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void loop();
+    void readEvents();
+    bool copyNewData(Follower& follower);
+    void followerEvent(int pipeFD, uint32_t events);
+    void fileChanged(const std::string& path);
+    void removeFollower(int pipeFD);
+    bool releaseWaiter(const PlaylistWaiter& waiter, bool timedOut);
+    void releaseWaiters(const std::string* path);
+    bool createPipe(int fds[2]);
+
+    std::string mFolder;
+    int mInotifyFD = -1;
+    int mEpollFD = -1;
+
+    std::mutex mMutex;
+    std::unordered_map<std::string, std::string> mGrowing;     // Written path by followed path. Normalized
+    std::unordered_map<int, Follower> mFollowers;   // By pipe write end
+    std::unordered_map<int, PlaylistWaiter> mPlaylistWaiters;   // By pipe write end
+
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+};
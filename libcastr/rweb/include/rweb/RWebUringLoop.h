@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+
+#include "rweb/RWebConnection.h"
+#include "rweb/RWebLoop.h"
+
+class RWebWorkerPool;
+class RWebClientLimiter;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+
+// io_uring reactor. Same behaviour as RWebEventLoop, but accept, recv,
+// send and file reads are queued in one submission ring and completed
+// asynchronously, so a read from a cold page cache never blocks the loop.
+// All operations of a loop iteration are submitted with one system call.
+// The ring is set up with raw system calls, so liburing is not needed.
+class RWebUringLoop : public RWebLoop
+{
+public:
+    RWebUringLoop(int listenFD, RequestHandler requestHandler,
+                  RWebWorkerPool* workerPool = nullptr,
+                  RWebClientLimiter* clientLimiter = nullptr);
+    ~RWebUringLoop();
+
+    // Returns false if io_uring is not available in this kernel
+    bool start() override;
+    void stop() override;
+
+private:
+
+    enum Operation
+    {
+        op_Accept,
+        op_Recv,
+        op_Send,
+        op_ReadBody,
+        op_Wake,
+        op_Timer,
+        op_PaceTimer,   // Resume connections waiting for their pacing rate
+        op_Cancel       // Ends the body read of a closed connection
+    };
+
+    // RWebConnection with the state of its queued operations.
+    // The socket is closed when no operation uses it any more.
+    struct UringConnection
+    {
+        RWebConnection connection;
+        int pendingOperations = 0;
+        bool recvPending = false;
+        bool sendPending = false;   // Send or body read queued
+        bool readBodyPending = false;
+        bool closing = false;
+
+        // Result of a recv that completed while a worker had the connection
+        bool recvDelayed = false;
+        int delayedRecvResult = 0;
+
+        std::vector<char> recvBuffer;
+    };
+
+    static const int sAcceptsInFlight = 8;
+
+    bool setupRing(unsigned entries);
+    void closeRing();
+    io_uring_sqe* getSqe(Operation operation, uint64_t key);
+    int submit(unsigned waitCount);
+
+    void loop();
+    void onCompletion(const io_uring_cqe& cqe);
+    void queueAccept(int slot);
+    void queueRecv(UringConnection& uringConnection);
+    void queueSend(UringConnection& uringConnection, const char* data, std::size_t size, bool more);
+    void queueReadBody(UringConnection& uringConnection);
+    void queueCancelReadBody(UringConnection& uringConnection);
+    void queueWake();
+    void queueTimer();
+    void onAccept(int slot, int result);
+    void onRecv(UringConnection& uringConnection, int result);
+    void onSend(UringConnection& uringConnection, int result);
+    void onReadBody(UringConnection& uringConnection, int result);
+    void startNextRequest(UringConnection& uringConnection);
+    void requestHandled(UringConnection& uringConnection, bool badRequest);
+    void postHandled(int fd);
+    void onHandled();
+    void sendMore(UringConnection& uringConnection);
+    void finishResponse(UringConnection& uringConnection);
+    void closeConnection(UringConnection& uringConnection);
+    void releaseClosedConnections();
+    void closeExpiredConnections();
+    void waitForPacer(UringConnection& uringConnection);
+    void scheduleSend(UringConnection& uringConnection);
+    void sendScheduledConnections();
+    void queuePaceTimer();
+    void resumePacedConnections();
+
+    int mListenFD;
+    int mRingFD = -1;
+    int mWakeFD = -1;   // eventfd. Written on stop() and when a worker is done
+    RequestHandler mRequestHandler;
+    RWebWorkerPool* mWorkerPool;
+    RWebClientLimiter* mClientLimiter;
+
+    // Ring memory shared with the kernel
+    void* mSqRing = nullptr;
+    void* mCqRing = nullptr;
+    std::size_t mSqRingSize = 0;
+    std::size_t mCqRingSize = 0;
+    io_uring_sqe* mSqes = nullptr;
+    std::size_t mSqesSize = 0;
+    unsigned* mSqHead = nullptr;
+    unsigned* mSqTail = nullptr;
+    unsigned* mSqArray = nullptr;
+    unsigned mSqMask = 0;
+    unsigned mSqEntries = 0;
+    unsigned* mCqHead = nullptr;
+    unsigned* mCqTail = nullptr;
+    unsigned mCqMask = 0;
+    io_uring_cqe* mCqes = nullptr;
+    unsigned mSqLocalTail = 0;
+    unsigned mSqSubmitted = 0;
+
+    // Buffers used by the kernel while operations are queued
+    std::array<struct sockaddr_storage, sAcceptsInFlight> mAcceptAddress;
+    std::array<socklen_t, sAcceptsInFlight> mAcceptAddressLength;
+    uint64_t mWakeValue = 0;
+    struct TimerSpec { int64_t seconds; int64_t nanoseconds; };    // Same as __kernel_timespec
+    TimerSpec mTimerSpec = {};
+    TimerSpec mPaceTimerSpec = {};
+
+    // Connections where the worker has finished the request handler
+    std::mutex mHandledMutex;
+    std::vector<int> mHandled;
+
+    std::unordered_map<int, std::unique_ptr<UringConnection>> mConnections;
+    std::vector<int> mClosedConnections;    // Released when no operation uses them
+    int mNextConnectionId = 0;
+    std::vector<int> mPacedConnections;     // Waiting until their pacedUntil
+    bool mPaceTimerQueued = false;
+
+    // Connections with a completed send or body read, by priority. The next
+    // operations are queued in priority order after each batch of completions,
+    // so the kernel sends manifests before it copies large file parts.
+    std::array<std::vector<int>, pr_Count> mSendQueues;
+
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+};
@@ -2,6 +2,11 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 bool
 found_in(const std::vector<std::string>& haystack,
@@ -16,13 +21,78 @@ split(const std::string& str, char delim);
 
 std::string ascii_to_lower(const std::string& str);
 
+bool equals_ignore_case(std::string_view a, std::string_view b);
+
 struct ExtensionMimeType
 {
-    std::string fileExtension;
-    std::string mimeType;
+    std::string_view fileExtension;
+    std::string_view mimeType;
+};
+
+// Returns mime type for known extensions or empty view.
+// Extension is matched case insensitive. No memory is allocated
+// unless mime types have been added with add_mime_type().
+std::string_view
+extension_to_mime_type(std::string_view filename);
+
+// Add or replace mime type of a file extension. Thread safe.
+// Returns false if extension is empty or too long
+bool
+add_mime_type(std::string_view extension, std::string_view mimeType);
+
+
+struct ByteRange
+{
+    off_t first;
+    off_t last;     // Last byte included in range, same as in Range header
 };
 
-// Returns mime type for known extensions or empty string
+enum class RangeParseResult
+{
+    NoRange,        // No header, or header we do not understand. Send full file
+    Satisfiable,
+    Unsatisfiable   // No range overlaps the file. Respond with 416
+};
+
+// Parse value of a Range header, like "bytes=0-499,-500", for a file of fileSize bytes.
+// Ranges are returned in file order, with overlapping and adjacent ranges merged.
+RangeParseResult
+parse_range_header(const std::string& value, off_t fileSize, std::vector<ByteRange>& ranges);
+
+
+// HTTP date, like "Sun, 06 Nov 1994 08:49:37 GMT"
 std::string
-extension_to_mime_type(const std::string& filename);
+format_http_date(time_t time);
+
+// Only the HTTP date format above. Obsolete formats return false
+bool
+parse_http_date(std::string_view value, time_t& time);
 
+// True if etag, or "*", is in the comma separated If-None-Match list.
+// Weak comparison, so a W/ prefix is ignored.
+bool
+etag_matches(std::string_view ifNoneMatch, std::string_view etag);
+
+
+// True if gzip is acceptable according to an Accept-Encoding header value
+bool
+accepts_gzip(std::string_view acceptEncoding);
+
+// Text formats, like playlists and manifests, that shrink when compressed
+bool
+is_compressible_mime_type(std::string_view mimeType);
+
+
+// Compress all of input to gzip format
+bool
+gzip_compress(std::string_view input, std::string& output);
+
+
+// Numeric address of an IPv4 or IPv6 socket address.
+// IPv4 clients on a dual-stack socket are shown as IPv4, not ::ffff:a.b.c.d
+std::string
+socket_address_to_string(const struct sockaddr_storage& address);
+
+// Run thread only on cpu. Returns false if not possible
+bool
+pin_thread_to_cpu(std::thread& thread, int cpu);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "utils/Metrics.h"
+
+
+struct RWebWorkerPoolStats
+{
+    std::size_t queueDepth = 0;         // Jobs waiting right now
+    std::size_t maxQueueDepth = 0;      // Highest queue depth seen
+    uint64_t jobsExecuted = 0;
+    uint64_t jobsRejected = 0;          // Rejected because queue was full
+    double lastWaitMs = 0.0;            // Time last job waited in queue
+    double averageWaitMs = 0.0;
+    double maxWaitMs = 0.0;
+};
+
+// Fixed number of threads executing jobs from a bounded queue.
+// submit() never blocks. When the queue is full the job is rejected,
+// so the caller can answer "503 Service Unavailable" right away.
+class RWebWorkerPool
+{
+public:
+    using Job = std::function<void()>;
+
+    RWebWorkerPool(int threadCount, std::size_t maxQueueSize);
+    ~RWebWorkerPool();
+
+    void start();
+    void stop();    // Waits for running jobs. Queued jobs are dropped
+
+    bool submit(Job job);
+
+    RWebWorkerPoolStats stats();
+
+private:
+
+    struct QueuedJob
+    {
+        Job job;
+        std::chrono::steady_clock::time_point queueTime;
+    };
+
+    void workerLoop();
+
+    int mThreadCount;
+    std::size_t mMaxQueueSize;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<QueuedJob> mQueue;
+    bool mRunning = false;
+    std::vector<std::thread> mThreads;
+
+    RWebWorkerPoolStats mStats;
+    double mTotalWaitMs = 0.0;
+
+    metrics::Gauge& mQueueDepth = metrics::Registry::global().gauge(
+        "rweb_worker_queue_depth", "Requests waiting for a worker thread");
+    metrics::Counter& mRejected = metrics::Registry::global().counter(
+        "rweb_worker_rejected_total", "Requests answered 503 because the worker queue was full");
+    metrics::Histogram& mQueueWait = metrics::Registry::global().histogram(
+        "rweb_worker_queue_wait_seconds", "Time requests waited in the queue for a worker thread");
+};
+
+// Limits number of simultaneous connections from one client address
+class RWebClientLimiter
+{
+public:
+    RWebClientLimiter(int maxConnectionsPerClient);
+
+    // Returns false if client already has max number of connections
+    bool acquire(const std::string& clientAddress);
+    void release(const std::string& clientAddress);
+
+private:
+    int mMaxConnectionsPerClient;
+    std::mutex mMutex;
+    std::unordered_map<std::string, int> mConnectionCount;
+};
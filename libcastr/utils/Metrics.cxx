@@ -0,0 +1,231 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "utils/Metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+
+namespace metrics
+{
+
+// Values 0 and 1 share bucket 0, so each bucket is (lower, upper] and
+// the upper bound can be used as the Prometheus "le" bound.
+static int bucket_index(uint64_t microseconds)
+{
+    uint64_t value = microseconds > 0 ? microseconds - 1 : 0;
+    if (value < (uint64_t)Histogram::sSubBuckets) { return (int)value; }
+
+    int powerOf2 = 63 - __builtin_clzll(value);
+    if (powerOf2 > Histogram::sMaxPowerOf2) { return Histogram::sOverflowBucket; }
+
+    int shift = powerOf2 - Histogram::sSubBucketBits;
+    return (shift + 1) * Histogram::sSubBuckets
+           + (int)((value >> shift) & (Histogram::sSubBuckets - 1));
+}
+
+static uint64_t bucket_upper_bound(int index)
+{
+    if (index == Histogram::sOverflowBucket) { return std::numeric_limits<uint64_t>::max(); }
+    if (index < Histogram::sSubBuckets) { return index + 1; }
+
+    int shift = index / Histogram::sSubBuckets - 1;
+    int subBucket = index % Histogram::sSubBuckets;
+    return (uint64_t)(Histogram::sSubBuckets + subBucket + 1) << shift;
+}
+
+static std::string escape_label_value(const std::string& value)
+{
+    std::string escaped;
+    for (char c : value)
+    {
+        if (c == '\\') { escaped += "\\\\"; }
+        else if (c == '"') { escaped += "\\\""; }
+        else if (c == '\n') { escaped += "\\n"; }
+        else { escaped += c; }
+    }
+    return escaped;
+}
+
+static std::string render_labels(const Labels& labels)
+{
+    std::string rendered;
+    for (auto& label : labels)
+    {
+        if (!rendered.empty()) { rendered += ","; }
+        rendered += label.first + "=\"" + escape_label_value(label.second) + "\"";
+    }
+    return rendered;
+}
+
+static std::string with_braces(const std::string& labels)
+{
+    return labels.empty() ? "" : "{" + labels + "}";
+}
+
+static std::string format_seconds(uint64_t microseconds)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", microseconds / 1e6);
+    return buffer;
+}
+
+
+void
+Histogram::record(std::chrono::steady_clock::duration duration)
+{
+    auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    recordMicroseconds(microseconds > 0 ? microseconds : 0);
+}
+
+void
+Histogram::recordMicroseconds(uint64_t microseconds)
+{
+    mBuckets[bucket_index(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+uint64_t
+Histogram::quantileMicroseconds(double quantile) const
+{
+    uint64_t total = 0;
+    for (auto& bucket : mBuckets) { total += bucket.load(std::memory_order_relaxed); }
+    if (total == 0) { return 0; }
+
+    uint64_t target = std::max<uint64_t>(1, std::ceil(quantile * total));
+    uint64_t cumulative = 0;
+    for (int i=0; i<sBucketCount; ++i)
+    {
+        cumulative += mBuckets[i].load(std::memory_order_relaxed);
+        if (cumulative >= target) { return bucket_upper_bound(i); }
+    }
+    return bucket_upper_bound(sBucketCount - 1);
+}
+
+std::string
+Histogram::render(const std::string& name, const std::string& labels) const
+{
+    std::string labelPrefix = labels.empty() ? "" : labels + ",";
+    std::string rendered;
+
+    // Buckets are updated one at a time, so the count is taken from
+    // the same snapshot as the buckets to keep +Inf equal to _count.
+    uint64_t cumulative = 0;
+    for (int i=0; i<sOverflowBucket; ++i)
+    {
+        cumulative += mBuckets[i].load(std::memory_order_relaxed);
+        uint64_t upperBound = bucket_upper_bound(i);
+        if ((upperBound & (upperBound - 1)) != 0) { continue; }     // Only powers of 2
+
+        rendered += name + "_bucket{" + labelPrefix + "le=\"" + format_seconds(upperBound) + "\"} "
+                    + std::to_string(cumulative) + "\n";
+    }
+    cumulative += mBuckets[sOverflowBucket].load(std::memory_order_relaxed);
+    rendered += name + "_bucket{" + labelPrefix + "le=\"+Inf\"} " + std::to_string(cumulative) + "\n";
+    rendered += name + "_sum" + with_braces(labels) + " " + format_seconds(sumMicroseconds()) + "\n";
+    rendered += name + "_count" + with_braces(labels) + " " + std::to_string(cumulative) + "\n";
+
+    return rendered;
+}
+
+
+Registry&
+Registry::global()
+{
+    static Registry sRegistry;
+    return sRegistry;
+}
+
+Registry::Family&
+Registry::family(const std::string& name, const std::string& help, Type type)
+{
+    auto it = mFamilies.find(name);
+    if (it == mFamilies.end())
+    {
+        it = mFamilies.emplace(name, Family()).first;
+        it->second.type = type;
+        it->second.help = help;
+    }
+    if (it->second.type != type)
+    {
+        throw std::logic_error("Metric " + name + " already used for another type");
+    }
+    return it->second;
+}
+
+Counter&
+Registry::counter(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto& metric = family(name, help, mt_Counter).counters[render_labels(labels)];
+    if (!metric) { metric = std::make_unique<Counter>(); }
+    return *metric;
+}
+
+Gauge&
+Registry::gauge(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto& metric = family(name, help, mt_Gauge).gauges[render_labels(labels)];
+    if (!metric) { metric = std::make_unique<Gauge>(); }
+    return *metric;
+}
+
+Histogram&
+Registry::histogram(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto& metric = family(name, help, mt_Histogram).histograms[render_labels(labels)];
+    if (!metric) { metric = std::make_unique<Histogram>(); }
+    return *metric;
+}
+
+std::string
+Registry::render()
+{
+    static const char* sTypeNames[] = { "counter", "gauge", "histogram" };
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::string rendered;
+    for (auto& item : mFamilies)
+    {
+        const std::string& name = item.first;
+        const Family& family = item.second;
+
+        rendered += "# HELP " + name + " " + family.help + "\n";
+        rendered += "# TYPE " + name + " " + sTypeNames[family.type] + "\n";
+        for (auto& metric : family.counters)
+        {
+            rendered += name + with_braces(metric.first) + " " + std::to_string(metric.second->value()) + "\n";
+        }
+        for (auto& metric : family.gauges)
+        {
+            rendered += name + with_braces(metric.first) + " " + std::to_string(metric.second->value()) + "\n";
+        }
+        for (auto& metric : family.histograms)
+        {
+            rendered += metric.second->render(name, metric.first);
+        }
+    }
+    return rendered;
+}
+
+}
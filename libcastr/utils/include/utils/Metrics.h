@@ -0,0 +1,132 @@
+/*
+    Copyright 2021 rundgong
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RCAST_METRICS_H_
+#define RCAST_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Process wide counters, gauges and latency histograms, rendered in
+// Prometheus text format. Updates are lock-free, so they can be used
+// in the RWeb event loops. Look a metric up once and keep the reference,
+// since the registry lookup takes a lock. Metrics are never removed.
+namespace metrics
+{
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    class Counter
+    {
+    public:
+        void add(uint64_t value = 1) { mValue.fetch_add(value, std::memory_order_relaxed); }
+        uint64_t value() const { return mValue.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> mValue{0};
+    };
+
+    class Gauge
+    {
+    public:
+        void set(int64_t value) { mValue.store(value, std::memory_order_relaxed); }
+        void add(int64_t value) { mValue.fetch_add(value, std::memory_order_relaxed); }
+        int64_t value() const { return mValue.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<int64_t> mValue{0};
+    };
+
+    // Latency histogram with HDR style log-linear buckets. Every power of 2
+    // microseconds is split in sSubBuckets linear buckets, so a quantile is
+    // never off by more than 1/sSubBuckets. Prometheus only gets the power
+    // of 2 bucket bounds, which keeps the number of series down.
+    class Histogram
+    {
+    public:
+        static constexpr int sSubBucketBits = 2;
+        static constexpr int sSubBuckets = 1 << sSubBucketBits;
+        static constexpr int sMaxPowerOf2 = 26;    // Buckets up to 2^27 us, about 134 s
+        static constexpr int sOverflowBucket = (sMaxPowerOf2 - sSubBucketBits + 2) * sSubBuckets;   // Longer values. Only counted in +Inf
+        static constexpr int sBucketCount = sOverflowBucket + 1;
+
+        void record(std::chrono::steady_clock::duration duration);
+        void recordMicroseconds(uint64_t microseconds);
+
+        uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+        uint64_t sumMicroseconds() const { return mSum.load(std::memory_order_relaxed); }
+
+        // Upper bound in microseconds of the bucket where quantile (0-1) is
+        // reached. UINT64_MAX if that is the overflow bucket
+        uint64_t quantileMicroseconds(double quantile) const;
+
+        std::string render(const std::string& name, const std::string& labels) const;
+
+    private:
+        std::array<std::atomic<uint64_t>, sBucketCount> mBuckets = {};
+        std::atomic<uint64_t> mCount{0};
+        std::atomic<uint64_t> mSum{0};
+    };
+
+    class Registry
+    {
+    public:
+        static Registry& global();
+
+        // Returns the existing metric if name and labels were used before.
+        // help is only used the first time a name is used. Throws
+        // std::logic_error if the name is used for another type of metric.
+        Counter& counter(const std::string& name, const std::string& help, const Labels& labels = {});
+        Gauge& gauge(const std::string& name, const std::string& help, const Labels& labels = {});
+        Histogram& histogram(const std::string& name, const std::string& help, const Labels& labels = {});
+
+        // Prometheus text exposition format 0.0.4
+        std::string render();
+
+    private:
+
+        enum Type
+        {
+            mt_Counter,
+            mt_Gauge,
+            mt_Histogram
+        };
+
+        struct Family
+        {
+            Type type;
+            std::string help;
+            std::map<std::string, std::unique_ptr<Counter>> counters;  // Key is rendered labels
+            std::map<std::string, std::unique_ptr<Gauge>> gauges;
+            std::map<std::string, std::unique_ptr<Histogram>> histograms;
+        };
+
+        Family& family(const std::string& name, const std::string& help, Type type);
+
+        std::mutex mMutex;
+        std::map<std::string, Family> mFamilies;
+    };
+}
+
+#endif /* RCAST_METRICS_H_ */